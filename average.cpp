@@ -3,98 +3,139 @@
 #include <iostream>
 #include <sstream>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <vector>
 #include <limits>
 #include <cassert>
 #include <cmath>
+#include "cfa-planes.hpp"
+#include "cfa-sampling.hpp"
 
 using std::size_t;
 
 int usage(const char* argv0, int returnValue)
 {
-    std::cerr << "Usage: " << argv0 << " filename [--xrange min..max] [--yrange min..max] [--error-on-misexposure]\n";
+    std::cerr << "Usage: " << argv0 << " filename [--xrange min..max] [--yrange min..max] [--error-on-misexposure]"
+                 " [--sample N [--refine]]\n"
+                 "  --sample N   average only one of every N rows of 2×2 quads, for a quick estimate\n"
+                 "  --refine     after printing the estimate, compute the exact averages\n";
     return returnValue;
 }
 
 bool errorOnMisexposure=false;
 
-bool printAverageColor(LibRaw& libRaw, const ushort (*img)[4], int xmin, int xmax, int ymin, int ymax,
-                       libraw_colordata_t const& colorData, const float (&rgbCoefs)[4])
+using Planes=CFAPlanes<ushort>;
+
+// Sources of the photosites of one channel in a row of quads: the photosite of quad qx is at row[qx*step]
+struct PlaneRows
+{
+    Planes const& planes;
+    static constexpr int step=1;
+    const ushort* operator()(const int channel, int /*row*/, int /*col*/, const int qy) const
+    {
+        return planes.row(channel,qy);
+    }
+};
+// Reads raw_image in place, which is cheaper than splitting it into planes when only a sample of the rows is read
+struct RawRows
+{
+    const ushort* data;
+    CFALayout const& layout;
+    static constexpr int step=2;
+    const ushort* operator()(int /*channel*/, const int row, const int col, const int qy) const
+    {
+        return data+std::size_t(layout.top+2*qy+row)*layout.stride+layout.left+col;
+    }
+};
+
+// The range is in photosites of the visible area
+template<typename Rows>
+bool printAverageColor(Rows const& rows, CFALayout const& layout, int xmin, int xmax, int ymin, int ymax,
+                       libraw_colordata_t const& colorData, const float (&rgbCoefs)[4], QuadRowSample const& sample)
 {
     const auto rgbCoefR =rgbCoefs[0];
     const auto rgbCoefG1=rgbCoefs[1];
     const auto rgbCoefB =rgbCoefs[2];
     const auto rgbCoefG2=rgbCoefs[3];
 
-    const auto w=libRaw.imgdata.sizes.iwidth;
-
     bool misexposure=false;
-    double red=0, green1=0, green2=0, blue=0;
-    int tooBlackPixelCount=0, tooWhitePixelCount=0;
-    int blackPixelCount=0, whitePixelCount=0;
-    for(int y=ymin;y<ymax;++y)
+    const unsigned black=colorData.black, white=colorData.maximum;
+    ClusterMean means[4];
+    std::uint64_t tooBlackPixelCount=0, tooWhitePixelCount=0;
+    std::uint64_t blackPixelCount=0, whitePixelCount=0;
+    for(int row=0;row<2;++row)
     {
-        for(int x=xmin;x<xmax;++x)
+        for(int col=0;col<2;++col)
         {
-            const auto colIndex=libRaw.FC(y,x);
-            auto pixelRaw=img[x+y*w][colIndex];
-            if(pixelRaw<colorData.black)
-            {
-                ++tooBlackPixelCount;
-                pixelRaw=colorData.black;
-            }
-            else if(pixelRaw>colorData.maximum)
-            {
-                ++tooWhitePixelCount;
-                pixelRaw=colorData.maximum;
-            }
-            if(pixelRaw==colorData.black)
-            {
-                ++blackPixelCount;
-            }
-            else if(pixelRaw==colorData.maximum)
+            // Quads whose photosite at (col,row) is inside the range
+            const int channel=layout.channels[row][col];
+            const int qxBegin=(xmin-col+1)/2, qxEnd=std::min(layout.width/2, (xmax-col+1)/2);
+            const int qyBegin=(ymin-row+1)/2, qyEnd=std::min(layout.height/2,(ymax-row+1)/2);
+            const int qyStep=sample.exact() ? 1 : sample.step;
+            std::uint64_t tooBlack=0, tooWhite=0, blacks=0, whites=0;
+            dispatchISA([&]
             {
-                ++whitePixelCount;
-            }
-
-            const auto pixel=pixelRaw-colorData.black;
-            switch(colIndex)
-            {
-            case 0: red+=pixel; break;
-            case 1: green1+=pixel; break;
-            case 2: blue+=pixel; break;
-            case 3: green2+=pixel; break;
-            default: assert(!"Must not get here!");
-            }
+                // Strata start at the top of the range
+                for(int qy=qyBegin+sample.first(0);qy<qyEnd;qy+=qyStep)
+                {
+                    const auto*const values=rows(channel,row,col,qy);
+                    std::uint64_t sum=0;
+                    for(int qx=qxBegin;qx<qxEnd;++qx)
+                    {
+                        const unsigned pixelRaw=values[qx*Rows::step];
+                        tooBlack += pixelRaw<black;
+                        tooWhite += pixelRaw>white;
+                        const auto pixel=std::min(std::max(pixelRaw,black),white);
+                        blacks += pixel==black;
+                        whites += pixel==white;
+                        sum += pixel-black;
+                    }
+                    means[channel].addCluster(sum, std::max(0,qxEnd-qxBegin));
+                }
+            });
+            tooBlackPixelCount+=tooBlack;
+            tooWhitePixelCount+=tooWhite;
+            blackPixelCount+=blacks;
+            whitePixelCount+=whites;
         }
     }
-    const auto count=double(ymax-ymin)*(xmax-xmin)/4;
-    red/=count;
-    green1/=count;
-    green2/=count;
-    blue/=count;
+    double red   =means[0].mean();
+    double green1=means[1].mean();
+    double blue  =means[2].mean();
+    double green2=means[3].mean();
+    // Counts of a sample are scaled to estimate those of the whole range
+    const char*const about = sample.exact() ? "" : "about ";
+    const auto scale = sample.exact() ? 1 : sample.step;
     if(tooBlackPixelCount)
     {
-        std::cerr << "Warning: " << tooBlackPixelCount << " pixels have values less than black level\n";
+        std::cerr << "Warning: " << about << tooBlackPixelCount*scale << " pixels have values less than black level\n";
         misexposure=true;
     }
     if(tooWhitePixelCount)
     {
-        std::cerr << "Warning: " << tooWhitePixelCount << " pixels have values greater than white level\n";
+        std::cerr << "Warning: " << about << tooWhitePixelCount*scale << " pixels have values greater than white level\n";
         misexposure=true;
     }
     if(blackPixelCount && !tooBlackPixelCount)
     {
-        std::cerr << "Warning: " << blackPixelCount << " pixels are underexposed\n";
+        std::cerr << "Warning: " << about << blackPixelCount*scale << " pixels are underexposed\n";
         misexposure=true;
     }
     if(whitePixelCount && !tooWhitePixelCount)
     {
-        std::cerr << "Warning: " << whitePixelCount << " pixels are overexposed\n";
+        std::cerr << "Warning: " << about << whitePixelCount*scale << " pixels are overexposed\n";
         misexposure=true;
     }
+    if(!sample.exact())
+        std::cout << "Estimated from one of every " << sample.step << " quad rows\n";
     std::cout << "Mean raw R,G1,G2,B minus black level: " << red << ',' << green1 << ',' << green2 << ',' << blue << '\n';
+    if(!sample.exact())
+    {
+        std::cout << "95% confidence interval half-widths: " << means[0].halfWidth95(sample) << ','
+                  << means[1].halfWidth95(sample) << ',' << means[3].halfWidth95(sample) << ','
+                  << means[2].halfWidth95(sample) << '\n';
+    }
 
     red*=rgbCoefR;
     green1*=rgbCoefG1;
@@ -156,6 +197,8 @@ int main(int argc, char** argv)
         return usage(argv[0],1);
     std::string filename;
     int xmin=0, ymin=0, xmax=INT_MAX, ymax=INT_MAX;
+    QuadRowSample sample;
+    bool refine=false;
     for(int i=1;i<argc;++i)
     {
         const auto arg=std::string(argv[i]);
@@ -193,6 +236,20 @@ int main(int argc, char** argv)
                 return 1;
             }
         }
+        else if(arg=="--sample")
+        {
+            ++i;
+            if(i>=argc) return requireParam(arg);
+            if(!(sample.step=parseSampleStep(argv[i])))
+            {
+                std::cerr << "Sample step must be a positive integer\n";
+                return 1;
+            }
+        }
+        else if(arg=="--refine")
+        {
+            refine=true;
+        }
         else if(arg=="--help" || arg=="-h")
         {
             return usage(argv[0],0);
@@ -218,14 +275,38 @@ int main(int argc, char** argv)
         return 2;
     }
 
-    std::cerr << "Convering raw data to image...\n";
-    libRaw.raw2image();
+    const auto*const rawImage=libRaw.imgdata.rawdata.raw_image;
+    const auto layout=rawImageLayout(libRaw);
+    if(!rawImage || !dispatchBayerLayout(layout.channels, [](auto){}))
+    {
+        std::cerr << "Only Bayer CFA is supported\n";
+        return 3;
+    }
     const auto& pre_mul=libRaw.imgdata.color.pre_mul;
     const float preMulMax=*std::max_element(std::begin(pre_mul),std::end(pre_mul));
     const float rgbCoefs[4]={pre_mul[0]/preMulMax,pre_mul[1]/preMulMax,pre_mul[2]/preMulMax,
                              (pre_mul[3] ? pre_mul[3] : pre_mul[1])/preMulMax};
-    if(xmax>sizes.iwidth ) xmax=sizes.iwidth;
-    if(ymax>sizes.iheight) ymax=sizes.iheight;
-    return printAverageColor(libRaw,libRaw.imgdata.image,xmin,xmax,ymin,ymax,libRaw.imgdata.color,rgbCoefs);
+    if(xmax>sizes.width ) xmax=sizes.width;
+    if(ymax>sizes.height) ymax=sizes.height;
+    if(!sample.exact() && sample.limitedTo((ymax-ymin)/2).exact())
+    {
+        std::cerr << "Range is too small to sample, averaging all of it\n";
+        sample={};
+    }
+    if(!sample.exact())
+    {
+        const bool misexposed=printAverageColor(RawRows{rawImage,layout},layout,xmin,xmax,ymin,ymax,
+                                                libRaw.imgdata.color,rgbCoefs,sample);
+        if(!refine)
+            return misexposed;
+        std::cout << "Refining to exact averages...\n";
+    }
+    const auto planes=Planes::split(rawImage, layout);
+    if(planes.empty())
+    {
+        std::cerr << "Failed to allocate memory for channel planes\n";
+        return 2;
+    }
+    return printAverageColor(PlaneRows{planes},layout,xmin,xmax,ymin,ymax,libRaw.imgdata.color,rgbCoefs,{});
 }
 
@@ -0,0 +1,193 @@
+#ifndef INCLUDE_ONCE_2AF3C3EB_156B_4AEF_86A2_8FBCA11DAE43
+#define INCLUDE_ONCE_2AF3C3EB_156B_4AEF_86A2_8FBCA11DAE43
+
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+#include "cfa-kernels.hpp"
+#include "cpu-dispatch.hpp"
+#include "cfa-sampling.hpp"
+
+// Histogram of raw CFA data that keeps each photosite of the 2×2 quad
+// separate, so that e.g. the two greens can be compared. Clipping counts and
+// basic statistics are gathered in the same pass over the data as the bins.
+class CFAHistogram
+{
+public:
+    // Same numbering as LibRaw's COLOR() and FC() give for Bayer sensors
+    enum Channel { Red, Green1, Blue, Green2, ChannelCount };
+
+    struct Params
+    {
+        int numBins;
+        float binsPerUnit; // 1 for integer data gives a bin per code value
+        float blackLevel;
+        float whiteLevel;
+        QuadRowSample sample{}; // quad rows to bin, all of them by default
+    };
+    using Layout = CFALayout;
+    struct ChannelStats
+    {
+        std::uint64_t total=0;
+        std::uint64_t underflow=0; // values below black level
+        std::uint64_t overflow=0;  // values above white level
+        double sum=0;
+        ClusterMean rows; // per-row sums, for the confidence interval of the mean of a sample
+        float min=+std::numeric_limits<float>::infinity();
+        float max=-std::numeric_limits<float>::infinity();
+        double mean() const { return total ? sum/total : NAN; }
+    };
+    // Half-width of the approximately 95% confidence interval of the channel's mean, zero for exact histograms
+    double meanHalfWidth95(const int channel) const { return stats_[channel].rows.halfWidth95(params_.sample); }
+    bool sampled() const { return !params_.sample.exact(); }
+
+    explicit CFAHistogram(Params const& params)
+        : params_(params)
+    {
+        // Two extra bins collect the values outside of the binned range
+        for(auto& counts : counts_)
+            counts.resize(params.numBins+2);
+    }
+
+    Params const& params() const { return params_; }
+    ChannelStats const& stats(const int channel) const { return stats_[channel]; }
+    // Bin counts of a channel, params().numBins of them
+    std::uint32_t const* counts(const int channel) const { return counts_[channel].data()+1; }
+    // Values that didn't get into any bin
+    std::uint32_t belowRange(const int channel) const { return counts_[channel].front(); }
+    std::uint32_t aboveRange(const int channel) const { return counts_[channel].back(); }
+    // Value below which the given fraction of the channel's values lies, to the resolution of a bin
+    float percentile(const int channel, const double fraction) const
+    {
+        const auto& stats = stats_[channel];
+        const auto& counts = counts_[channel];
+        const double target = fraction*stats.total;
+        double cumulative = counts.front();
+        if(cumulative > target)
+            return stats.min;
+        for(int bin=0; bin<params_.numBins; ++bin)
+        {
+            cumulative += counts[bin+1];
+            if(cumulative > target)
+                return bin/params_.binsPerUnit;
+        }
+        return stats.max;
+    }
+
+    // Rows are relative to the visible area, yBegin must be even. Of these, only the rows of params().sample are binned.
+    template<typename Pixel>
+    void accumulate(Pixel const* data, Layout const& layout, int yBegin, int yEnd)
+    {
+        dispatchISA([&]{ accumulateRows(data, layout, yBegin, yEnd); });
+    }
+    void merge(CFAHistogram const& other)
+    {
+        for(int c=0; c<ChannelCount; ++c)
+        {
+            for(std::size_t bin=0; bin<counts_[c].size(); ++bin)
+                counts_[c][bin] += other.counts_[c][bin];
+            auto& stats = stats_[c];
+            auto const& otherStats = other.stats_[c];
+            stats.total     += otherStats.total;
+            stats.underflow += otherStats.underflow;
+            stats.overflow  += otherStats.overflow;
+            stats.sum       += otherStats.sum;
+            stats.rows.merge(otherStats.rows);
+            stats.min = std::min(stats.min, otherStats.min);
+            stats.max = std::max(stats.max, otherStats.max);
+        }
+    }
+
+    // Splits the image into horizontal bands and accumulates them in separate threads
+    template<typename Pixel>
+    static CFAHistogram compute(Pixel const* data, Layout const& layout, Params const& params, unsigned threadCount)
+    {
+        threadCount = std::max(1u, threadCount);
+        const unsigned quadRows = layout.height/2;
+        std::vector<CFAHistogram> parts(threadCount, CFAHistogram(params));
+        std::vector<std::thread> threads;
+        for(unsigned n=0; n<threadCount; ++n)
+        {
+            threads.emplace_back([&parts,&layout,data,quadRows,threadCount,n]
+                                 { parts[n].accumulate(data, layout, 2*(quadRows* n   /threadCount),
+                                                                     2*(quadRows*(n+1)/threadCount)); });
+        }
+        for(auto& thread : threads)
+            thread.join();
+        for(unsigned n=1; n<threadCount; ++n)
+            parts[0].merge(parts[n]);
+        return parts[0];
+    }
+
+private:
+    template<typename Pixel>
+    void accumulateRows(Pixel const* data, Layout const& layout, int yBegin, int yEnd);
+
+private:
+    Params params_;
+    std::vector<std::uint32_t> counts_[ChannelCount];
+    ChannelStats stats_[ChannelCount];
+};
+
+template<typename Pixel>
+void CFAHistogram::accumulateRows(Pixel const*const data, Layout const& layout, const int yBegin, const int yEnd)
+{
+    using Sum = std::conditional_t<std::is_integral<Pixel>::value, std::uint64_t, double>;
+
+    // Only complete quads are counted
+    const int width = layout.width/2*2;
+    const int rowEnd = std::min(yEnd, layout.height/2*2);
+    const float binsPerUnit = params_.binsPerUnit;
+    const float lastIndex = params_.numBins+1;
+    const float black = params_.blackLevel, white = params_.whiteLevel;
+    std::vector<int> indices(width);
+    const auto& sample = params_.sample;
+    const int quadRowStep = sample.exact() ? 1 : sample.step;
+    for(int quadRow=sample.first(yBegin/2); 2*quadRow<rowEnd; quadRow+=quadRowStep)
+    for(int y=2*quadRow; y<2*quadRow+2 && y<rowEnd; ++y)
+    {
+        const auto*const row = data + std::size_t(layout.top+y)*layout.stride + layout.left;
+        // Branchless, so that the compiler can vectorize it. Index 0 is for the values below the binned range,
+        // and truncation works as floor for the rest. NaNs go to index 0 too.
+        for(int x=0; x<width; ++x)
+            indices[x] = std::min(std::max(0.f, float(row[x])*binsPerUnit + 1), lastIndex);
+
+        for(int parity=0; parity<2; ++parity)
+        {
+            const int channel = layout.channels[y%2][parity];
+            auto*const counts = counts_[channel].data();
+            Sum sum=0;
+            std::uint64_t underflow=0, overflow=0;
+            auto min = std::numeric_limits<Pixel>::max();
+            auto max = std::numeric_limits<Pixel>::lowest();
+            for(int x=parity; x<width; x+=2)
+            {
+                const auto v = row[x];
+                ++counts[indices[x]];
+                sum += v;
+                underflow += v < black;
+                overflow  += v > white;
+                min = std::min(min, v);
+                max = std::max(max, v);
+            }
+            auto& stats = stats_[channel];
+            stats.total += width/2;
+            stats.sum += sum;
+            stats.rows.addCluster(sum, width/2);
+            stats.underflow += underflow;
+            stats.overflow += overflow;
+            if(width)
+            {
+                stats.min = std::min(stats.min, float(min));
+                stats.max = std::max(stats.max, float(max));
+            }
+        }
+    }
+}
+
+#endif
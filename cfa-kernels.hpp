@@ -0,0 +1,61 @@
+#ifndef INCLUDE_ONCE_5879EFA0_3347_4C26_B9D2_CC61C7F1A657
+#define INCLUDE_ONCE_5879EFA0_3347_4C26_B9D2_CC61C7F1A657
+
+#include <tuple>
+#include <cstddef>
+
+// Helpers to resolve the Bayer layout of an image once, before entering a
+// per-photosite loop. A kernel is a generic lambda taking a tag argument,
+// whose type carries the layout as compile-time constants, so the kernel is
+// instantiated for each layout. Loops not written as such kernels, like
+// CFAHistogram's, which resolves the channels per row, don't benefit.
+// Per-channel options like clipping and white balance are folded into lookup
+// tables instead, see cfa-lut.hpp.
+
+// Visible area of raw CFA data, and the channels of the photosites of its top-left quad
+struct CFALayout
+{
+    std::size_t stride;
+    int left, top;
+    int width, height;
+    int channels[2][2];
+};
+
+// Channels of the top-left 2×2 quad of the visible area, numbered as LibRaw's
+// COLOR() does for Bayer sensors: 0 is red, 1 and 3 are the greens, 2 is blue.
+template<int C00, int C01, int C10, int C11>
+struct BayerLayout
+{
+    static constexpr int c00=C00, c01=C01, c10=C10, c11=C11;
+    // Channel of the photosite at the given offset from the top-left one of a quad
+    static constexpr int channel(const int row, const int col)
+    {
+        return row%2 ? (col%2 ? C11 : C10) : (col%2 ? C01 : C00);
+    }
+    static bool matches(const int (&channels)[2][2])
+    {
+        return channels[0][0]==C00 && channels[0][1]==C01 && channels[1][0]==C10 && channels[1][1]==C11;
+    }
+};
+
+// RGGB, BGGR, GRBG, GBRG, each with either green counted as the first one
+using BayerLayouts = std::tuple<BayerLayout<0,1,3,2>, BayerLayout<0,3,1,2>,
+                                BayerLayout<2,3,1,0>, BayerLayout<2,1,3,0>,
+                                BayerLayout<1,0,2,3>, BayerLayout<3,0,2,1>,
+                                BayerLayout<1,2,0,3>, BayerLayout<3,2,0,1>>;
+
+template<typename Kernel, typename... Layouts>
+bool dispatchBayerLayout(const int (&channels)[2][2], Kernel&& kernel, std::tuple<Layouts...>*)
+{
+    return ((Layouts::matches(channels) && (kernel(Layouts{}), true)) || ...);
+}
+
+// Calls kernel(BayerLayout<...>{}) for the layout with the given channels of the top-left quad.
+// Returns false if there's no such layout, e.g. for X-Trans or non-RGB sensors.
+template<typename Kernel>
+bool dispatchBayerLayout(const int (&channels)[2][2], Kernel&& kernel)
+{
+    return dispatchBayerLayout(channels, kernel, static_cast<BayerLayouts*>(nullptr));
+}
+
+#endif
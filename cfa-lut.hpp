@@ -0,0 +1,73 @@
+#ifndef INCLUDE_ONCE_407FEAA1_C350_44D9_9E0B_47E1267C3944
+#define INCLUDE_ONCE_407FEAA1_C350_44D9_9E0B_47E1267C3944
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include "cpu-dispatch.hpp"
+#if CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+// Per-channel tables mapping 16-bit raw codes to output values. Black level
+// subtraction, clipping, white balance and quantization of a sample then cost
+// a single lookup, however many of them a tool applies.
+template<typename Value, int ChannelCount=4>
+class ChannelLUT
+{
+public:
+    static constexpr std::size_t SIZE = 1<<16;
+
+    // transform(channel, code) gives the value for the code
+    template<typename Transform>
+    explicit ChannelLUT(Transform&& transform)
+        : tables_(ChannelCount*SIZE)
+    {
+        for(int c=0; c<ChannelCount; ++c)
+            for(std::size_t code=0; code<SIZE; ++code)
+                tables_[c*SIZE+code] = transform(c, std::uint16_t(code));
+    }
+
+    Value const* table(const int channel) const { return tables_.data()+channel*SIZE; }
+    Value operator()(const int channel, const std::uint16_t code) const { return table(channel)[code]; }
+
+    // Looks up count codes of the channel. 32-bit values are gathered eight at a time where AVX2 is available.
+    void apply(const int channel, std::uint16_t const*const in, Value*const out, const int count) const
+    {
+        const auto*const table = this->table(channel);
+        int x=0;
+#if CPU_DISPATCH_X86
+        if constexpr(sizeof(Value)==4)
+        {
+            if(selectedISA() >= ISA::AVX2)
+                x = gatherAVX2(table, in, out, count);
+        }
+#endif
+        for(; x<count; ++x)
+            out[x] = table[in[x]];
+    }
+
+private:
+#if CPU_DISPATCH_X86
+    // Returns the number of values done
+    CPU_TARGET_AVX2 static int gatherAVX2(Value const*const table, std::uint16_t const*const in, Value*const out, const int count)
+    {
+        int x=0;
+        for(; x+8<=count; x+=8)
+        {
+            const auto codes = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in+x)));
+            if constexpr(std::is_same<Value,float>::value)
+                _mm256_storeu_ps(out+x, _mm256_i32gather_ps(table, codes, 4));
+            else
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out+x),
+                                    _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), codes, 4));
+        }
+        return x;
+    }
+#endif
+
+    std::vector<Value> tables_;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef INCLUDE_ONCE_A376CEF6_9F03_499D_8466_8A18DE5EB858
+#define INCLUDE_ONCE_A376CEF6_9F03_499D_8466_8A18DE5EB858
+
+#include <limits>
+#include <climits>
+#include <memory>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <libraw/libraw.h>
+#include "cfa-kernels.hpp"
+#include "cpu-dispatch.hpp"
+
+// Bayer CFA data split into four quarter-resolution planes, one per channel of
+// the 2×2 quad, so that the kernels working on quads read each channel with
+// unit stride. Only complete quads of the visible area are kept, and plane rows
+// start at cache line boundaries.
+template<typename Sample>
+class CFAPlanes
+{
+public:
+    // Same numbering as LibRaw's COLOR() gives for Bayer sensors
+    enum Channel { Red, Green1, Blue, Green2, ChannelCount };
+
+    CFAPlanes() = default;
+    bool empty() const { return !data_; }
+    // Sizes are in quads, stride is in samples
+    int width() const { return width_; }
+    int height() const { return height_; }
+    std::size_t stride() const { return stride_; }
+    Sample const* row(const int channel, const int y) const { return data_.get() + (std::size_t(channel)*height_+y)*stride_; }
+
+    // Returns an empty object for layouts other than Bayer
+    static CFAPlanes split(Sample const*const data, CFALayout const& layout)
+    {
+        CFAPlanes planes = allocate(layout.width/2, layout.height/2);
+        if(planes.empty())
+            return {};
+        if(!dispatchBayerLayout(layout.channels, [&](auto bayer)
+                                {dispatchISA([&]{ planes.splitRows<decltype(bayer)>(data, layout); });}))
+            return {};
+        return planes;
+    }
+
+    // Averages boxes of factor×factor quads, dropping the incomplete ones at the right and bottom. A box
+    // with any sample above clipLevel gets the maximum instead of the mean, so that clipping stays visible.
+    CFAPlanes downscaled(const int factor, const Sample clipLevel) const
+    {
+        CFAPlanes planes = allocate(width_/factor, height_/factor);
+        if(planes.empty())
+            return {};
+        dispatchISA([&]
+        {
+            using Sum = std::conditional_t<std::is_integral<Sample>::value, std::uint64_t, double>;
+            std::vector<Sum> sums(planes.width_);
+            std::vector<Sample> maxima(planes.width_);
+            const Sum boxSize = Sum(factor)*factor;
+            for(int c=0; c<ChannelCount; ++c)
+            {
+                for(int y=0; y<planes.height_; ++y)
+                {
+                    std::fill(sums.begin(), sums.end(), 0);
+                    std::fill(maxima.begin(), maxima.end(), std::numeric_limits<Sample>::lowest());
+                    for(int dy=0; dy<factor; ++dy)
+                    {
+                        const auto*const in = row(c, y*factor+dy);
+                        for(int x=0; x<planes.width_; ++x)
+                        {
+                            for(int dx=0; dx<factor; ++dx)
+                            {
+                                const auto v = in[x*factor+dx];
+                                sums[x] += v;
+                                maxima[x] = std::max(maxima[x], v);
+                            }
+                        }
+                    }
+                    auto*const out = planes.mutableRow(c,y);
+                    for(int x=0; x<planes.width_; ++x)
+                    {
+                        const auto mean = std::is_integral<Sample>::value ? (sums[x]+boxSize/2)/boxSize : sums[x]/boxSize;
+                        out[x] = maxima[x]>clipLevel ? maxima[x] : Sample(mean);
+                    }
+                }
+            }
+        });
+        return planes;
+    }
+
+private:
+    static CFAPlanes allocate(const int width, const int height)
+    {
+        CFAPlanes planes;
+        planes.width_ = width;
+        planes.height_ = height;
+        constexpr std::size_t samplesPerLine = ALIGNMENT/sizeof(Sample);
+        planes.stride_ = (planes.width_+samplesPerLine-1)/samplesPerLine*samplesPerLine;
+        const auto size = ChannelCount*planes.stride_*planes.height_*sizeof(Sample);
+        planes.data_.reset(static_cast<Sample*>(std::aligned_alloc(ALIGNMENT, std::max(size, ALIGNMENT))));
+        if(!planes.data_)
+            return {};
+        return planes;
+    }
+    Sample* mutableRow(const int channel, const int y) { return data_.get() + (std::size_t(channel)*height_+y)*stride_; }
+
+    template<typename Bayer>
+    void splitRows(Sample const*const data, CFALayout const& layout)
+    {
+        for(int y=0; y<height_; ++y)
+        {
+            const auto*const top = data + std::size_t(layout.top+2*y)*layout.stride + layout.left;
+            deinterleave(top,               mutableRow(Bayer::c00,y), mutableRow(Bayer::c01,y));
+            deinterleave(top + layout.stride, mutableRow(Bayer::c10,y), mutableRow(Bayer::c11,y));
+        }
+    }
+    // A plain loop, so that the compiler can vectorize it into shuffles for the selected ISA
+    void deinterleave(Sample const*__restrict const in, Sample*__restrict const even, Sample*__restrict const odd) const
+    {
+        for(int x=0; x<width_; ++x)
+        {
+            even[x] = in[2*x+0];
+            odd [x] = in[2*x+1];
+        }
+    }
+
+private:
+    static constexpr std::size_t ALIGNMENT = 64;
+    struct Free { void operator()(Sample*const p) const { std::free(p); } };
+    std::unique_ptr<Sample[], Free> data_;
+    int width_=0, height_=0;
+    std::size_t stride_=0;
+};
+
+// Distance between rows of the unpacked raw data, in samples. Rows of raw_image may be
+// padded, as raw_pitch tells, while float data are stored without padding.
+inline int rawImageStride(LibRaw& libRaw)
+{
+    const auto& sizes = libRaw.imgdata.sizes;
+    return libRaw.have_fpdata() ? sizes.raw_width : sizes.raw_pitch/sizeof libRaw.imgdata.rawdata.raw_image[0];
+}
+
+// Layout of the visible area in LibRaw's raw_image, or of a region of it.
+// The region is in photosites of the visible area, and is clipped to it.
+inline CFALayout rawImageLayout(LibRaw& libRaw, int left=0, int top=0, int width=INT_MAX, int height=INT_MAX)
+{
+    const auto& sizes = libRaw.imgdata.sizes;
+    left = std::min(std::max(0, left), int(sizes.width));
+    top = std::min(std::max(0, top), int(sizes.height));
+    CFALayout layout;
+    layout.stride = rawImageStride(libRaw);
+    layout.left = sizes.left_margin + left;
+    layout.top = sizes.top_margin + top;
+    layout.width = std::min(std::max(0, width), sizes.width - left);
+    layout.height = std::min(std::max(0, height), sizes.height - top);
+    for(int row=0; row<2; ++row)
+        for(int col=0; col<2; ++col)
+            layout.channels[row][col] = libRaw.COLOR(top+row, left+col);
+    return layout;
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef INCLUDE_ONCE_98D0792B_2463_40AA_8933_C6FC201AB828
+#define INCLUDE_ONCE_98D0792B_2463_40AA_8933_C6FC201AB828
+
+#include <cmath>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+// Quick-look statistics from a subset of an image. The quad rows are split into
+// strata of `step` consecutive rows, and the middle row of each stratum is
+// processed, which is systematic sampling: every part of the image is
+// represented, and the cost drops by the factor of step. Each sampled row is
+// a cluster of photosites for the error estimate, since neighbouring
+// photosites are too correlated to count as independent samples.
+struct QuadRowSample
+{
+    int step=1;
+
+    bool exact() const { return step<=1; }
+    // First sampled quad row at or after the given one. Rows are counted from where the strata begin.
+    int first(const int quadRow) const
+    {
+        if(exact()) return quadRow;
+        const int offset = step/2;
+        return quadRow + ((offset-quadRow)%step+step)%step;
+    }
+    // Fraction of the rows that aren't sampled, for the finite population correction
+    double unsampledFraction() const { return exact() ? 0 : 1-1./step; }
+    // Sampling would leave too few rows of a small range for a meaningful estimate, and small ranges
+    // are quick to process anyway, so they are processed whole
+    static constexpr int MIN_SAMPLED_ROWS=64;
+    QuadRowSample limitedTo(const int quadRows) const
+    {
+        return quadRows >= MIN_SAMPLED_ROWS*step ? *this : QuadRowSample{};
+    }
+};
+
+// Mean of photosite values estimated from sums over sampled rows, with the
+// confidence interval of the ratio estimator for cluster sampling
+class ClusterMean
+{
+public:
+    void addCluster(const double sum, const std::uint64_t count)
+    {
+        ++clusters_;
+        sum_ += sum;
+        count_ += count;
+        sumSq_ += sum*sum;
+        countSq_ += double(count)*count;
+        sumCount_ += sum*count;
+    }
+    void merge(ClusterMean const& other)
+    {
+        clusters_ += other.clusters_;
+        sum_ += other.sum_;
+        count_ += other.count_;
+        sumSq_ += other.sumSq_;
+        countSq_ += other.countSq_;
+        sumCount_ += other.sumCount_;
+    }
+
+    std::uint64_t clusters() const { return clusters_; }
+    double mean() const { return count_ ? sum_/count_ : NAN; }
+    // Half-width of the approximately 95% confidence interval of mean(). Zero when all the rows were used.
+    double halfWidth95(QuadRowSample const& sample) const
+    {
+        if(sample.exact()) return 0;
+        if(clusters_<2) return INFINITY;
+        const double n = clusters_;
+        const double m = mean();
+        const double meanCount = count_/n;
+        // Sum of squared residuals of the cluster sums from the overall mean. Clamped, since it's a difference
+        // of large numbers, which may come out slightly negative for nearly uniform data.
+        const double residuals = std::max(0., sumSq_ - 2*m*sumCount_ + m*m*countSq_);
+        const double variance = sample.unsampledFraction() * residuals/(n-1) / (n*meanCount*meanCount);
+        return 1.96*std::sqrt(variance);
+    }
+
+private:
+    std::uint64_t clusters_=0;
+    double sum_=0;
+    std::uint64_t count_=0;
+    double sumSq_=0, countSq_=0, sumCount_=0;
+};
+
+// Parses the argument of a --sample option, returns 0 if it's not a positive integer
+inline int parseSampleStep(std::string const& str)
+{
+    try
+    {
+        std::size_t pos;
+        const auto step=std::stoi(str, &pos);
+        return pos==str.size() && step>0 ? step : 0;
+    }
+    catch(...)
+    {
+        return 0;
+    }
+}
+
+#endif
@@ -35,6 +35,8 @@ namespace filesystem=std::filesystem;
 
 #include "util.h"
 #include "timing.h"
+#include "cfa-planes.hpp"
+#include "cfa-lut.hpp"
 
 static constexpr auto sqr=[](auto x){return x*x;};
 using std::isnan;
@@ -783,8 +785,16 @@ auto MainWindow::readImage(Time time) const -> Image
         statusBar()->showMessage("Failed to read file");
         return Image{{glm::vec3(1,0,1)},1,1};
     }
-    statusBar()->showMessage("Converting RAW data to image...");
-    libRaw.raw2image();
+    statusBar()->showMessage("Splitting RAW data into channel planes...");
+    const auto*const rawImage=libRaw.imgdata.rawdata.raw_image;
+    const auto planes=rawImage ? CFAPlanes<ushort>::split(rawImage, rawImageLayout(libRaw)) : CFAPlanes<ushort>{};
+    if(planes.empty())
+    {
+        QMessageBox::critical(const_cast<MainWindow*>(this), tr("Failed to read image"),
+                              tr("File \"%1\" doesn't have Bayer CFA data").arg(path));
+        statusBar()->showMessage("Failed to read file");
+        return Image{{glm::vec3(1,0,1)},1,1};
+    }
 
     statusBar()->showMessage("Preparing file data for rendering...");
     const auto& pre_mul=libRaw.imgdata.color.pre_mul;
@@ -793,35 +803,35 @@ auto MainWindow::readImage(Time time) const -> Image
 
     const float white=libRaw.imgdata.rawdata.color.maximum;
     const float black=libRaw.imgdata.rawdata.color.black;
-    const ushort (*const data)[4]=libRaw.imgdata.image;
 
     // TODO: move the conversion to GLSL code (render to FBO, generate mipmap and render to screen)
-    const auto rgbCoefR =daylightWBCoefs[0];
-    const auto rgbCoefG1=daylightWBCoefs[1];
-    const auto rgbCoefB =daylightWBCoefs[2];
-    const auto rgbCoefG2=daylightWBCoefs[3];
-    const auto clampAndSubB=[black,white](ushort p, bool& overexposed)
-        {return (p>white-10 ? overexposed=true,white : p<black ? black : p)-black; };
+    const auto clampAndSubB=[black,white](ushort p)
+        {return (p>white-10 ? white : p<black ? black : p)-black; };
+    const ChannelLUT<ushort> values([&](const int channel, const ushort p)
+        {return ushort(daylightWBCoefs[channel]*clampAndSubB(p)); });
     const auto col=[black,white](float p) {return p/(white-black);};
 
-    enum {RED,GREEN1,BLUE,GREEN2};
-    const int stride=libRaw.imgdata.sizes.iwidth;
-    const int w=libRaw.imgdata.sizes.iwidth/2;
-    const int h=libRaw.imgdata.sizes.iheight/2;
+    using Planes=CFAPlanes<ushort>;
+    const int w=planes.width();
+    const int h=planes.height();
     Image img{{},w,h};
+    img.data.reserve(std::size_t(w)*h);
     for(int y=0;y<h;++y)
     {
+        const auto*const rowR =planes.row(Planes::Red   ,y);
+        const auto*const rowG1=planes.row(Planes::Green1,y);
+        const auto*const rowG2=planes.row(Planes::Green2,y);
+        const auto*const rowB =planes.row(Planes::Blue  ,y);
         for(int x=0;x<w;++x)
         {
-            const auto X=x*2, Y=y*2;
-            bool overexposed=false;
-            const ushort pixelTopLeft    =rgbCoefR *clampAndSubB(data[X+0+(Y+0)*stride][RED]   ,overexposed);
-            const ushort pixelTopRight   =rgbCoefG1*clampAndSubB(data[X+1+(Y+0)*stride][GREEN1],overexposed);
-            const ushort pixelBottomLeft =rgbCoefG2*clampAndSubB(data[X+0+(Y+1)*stride][GREEN2],overexposed);
-            const ushort pixelBottomRight=rgbCoefB *clampAndSubB(data[X+1+(Y+1)*stride][BLUE]  ,overexposed);
-
-            const auto green=(pixelTopRight+pixelBottomLeft)/2.;
-            const auto red=pixelTopLeft, blue=pixelBottomRight;
+            const bool overexposed=(rowR[x]>white-10) | (rowG1[x]>white-10) | (rowG2[x]>white-10) | (rowB[x]>white-10);
+            const ushort pixelR =values(Planes::Red   ,rowR [x]);
+            const ushort pixelG1=values(Planes::Green1,rowG1[x]);
+            const ushort pixelG2=values(Planes::Green2,rowG2[x]);
+            const ushort pixelB =values(Planes::Blue  ,rowB [x]);
+
+            const auto green=(pixelG1+pixelG2)/2.;
+            const auto red=pixelR, blue=pixelB;
 
             const auto& cam2srgb=libRaw.imgdata.rawdata.color.rgb_cam;
             const auto srgblR=cam2srgb[0][0]*red+cam2srgb[0][1]*green+cam2srgb[0][2]*blue;
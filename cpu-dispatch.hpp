@@ -0,0 +1,111 @@
+#ifndef INCLUDE_ONCE_3190CFDC_5786_4A4A_A4A8_2BCAA6B283CB
+#define INCLUDE_ONCE_3190CFDC_5786_4A4A_A4A8_2BCAA6B283CB
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// Runtime selection of the instruction set for the hot loops, so that a
+// single portable build gets the SIMD width of the machine it runs on.
+//
+// A kernel is a callable run through dispatchISA(). Each ISA variant of the
+// runner is compiled with the corresponding target and flattened, so the
+// kernel and everything it calls are inlined into it and vectorized for that
+// target. The choice can be forced with RAWTOOLS_ISA=generic|sse4.2|avx2|avx512,
+// e.g. for benchmarking; variants the CPU doesn't support are refused.
+
+enum class ISA { Generic, SSE42, AVX2, AVX512 };
+
+inline const char* isaName(const ISA isa)
+{
+    switch(isa)
+    {
+    case ISA::Generic: return "generic";
+    case ISA::SSE42:   return "sse4.2";
+    case ISA::AVX2:    return "avx2";
+    case ISA::AVX512:  return "avx512";
+    }
+    return "unknown";
+}
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+# define CPU_DISPATCH_X86 1
+# define CPU_TARGET_SSE42  __attribute__((target("sse4.2,popcnt")))
+# define CPU_TARGET_AVX2   __attribute__((target("avx2,fma,bmi,bmi2,f16c,popcnt")))
+# define CPU_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,avx2,fma,bmi,bmi2,f16c,popcnt")))
+#else
+# define CPU_DISPATCH_X86 0
+#endif
+
+inline ISA bestSupportedISA()
+{
+#if CPU_DISPATCH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+       __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq"))
+        return ISA::AVX512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("bmi2"))
+        return ISA::AVX2;
+    if(__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+        return ISA::SSE42;
+#endif
+    return ISA::Generic;
+}
+
+inline ISA selectISA()
+{
+    const auto best = bestSupportedISA();
+    const char*const forced = std::getenv("RAWTOOLS_ISA");
+    if(!forced || !*forced)
+        return best;
+    for(const auto isa : {ISA::Generic, ISA::SSE42, ISA::AVX2, ISA::AVX512})
+    {
+        if(std::strcmp(forced, isaName(isa)) != 0)
+            continue;
+        if(isa > best)
+        {
+            std::cerr << "Warning: RAWTOOLS_ISA=" << forced << " is not supported by this CPU, using "
+                      << isaName(best) << "\n";
+            return best;
+        }
+        return isa;
+    }
+    std::cerr << "Warning: unknown RAWTOOLS_ISA=" << forced << ", using " << isaName(best) << "\n";
+    return best;
+}
+
+// Decided once per process
+inline ISA selectedISA()
+{
+    static const ISA isa = selectISA();
+    return isa;
+}
+
+namespace cpu_dispatch_detail
+{
+template<typename Kernel> __attribute__((flatten)) void runGeneric(Kernel& kernel) { kernel(); }
+#if CPU_DISPATCH_X86
+template<typename Kernel> CPU_TARGET_SSE42  __attribute__((flatten)) void runSSE42 (Kernel& kernel) { kernel(); }
+template<typename Kernel> CPU_TARGET_AVX2   __attribute__((flatten)) void runAVX2  (Kernel& kernel) { kernel(); }
+template<typename Kernel> CPU_TARGET_AVX512 __attribute__((flatten)) void runAVX512(Kernel& kernel) { kernel(); }
+#endif
+}
+
+// Runs kernel() compiled for the selected ISA
+template<typename Kernel>
+void dispatchISA(Kernel&& kernel)
+{
+    using namespace cpu_dispatch_detail;
+#if CPU_DISPATCH_X86
+    switch(selectedISA())
+    {
+    case ISA::AVX512: runAVX512(kernel); return;
+    case ISA::AVX2:   runAVX2  (kernel); return;
+    case ISA::SSE42:  runSSE42 (kernel); return;
+    case ISA::Generic: break;
+    }
+#endif
+    runGeneric(kernel);
+}
+
+#endif
@@ -4,15 +4,24 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <climits>
 #include <cassert>
 #include <sstream>
 #include <numeric>
 #include <vector>
 #include <cmath>
+#include <thread>
+#include <optional>
+#include <filesystem>
 #define cimg_use_tiff
+#define cimg_use_png
 #define cimg_display 0
 #include <CImg.h>
 #include "cmdline-show-help.hpp"
+#include "cfa-planes.hpp"
+#include "cfa-lut.hpp"
+#include "cfa-sampling.hpp"
+#include "quantile-sketch.hpp"
 
 using std::uint8_t;
 using std::size_t;
@@ -24,6 +33,12 @@ bool needCombinedFile=false;
 bool needTIFFFile=false;
 bool needUnweightedTIFF=false;
 bool needF32=false;
+bool needPNG16=false;
+bool needTIFF16=false;
+bool needPPM16=false;
+bool linear16=false;
+bool needMosaicNPY=false;
+bool needPlanesNPY=false;
 bool needRedFile=false;
 bool needGreen1File=false;
 bool needGreen2File=false;
@@ -37,6 +52,18 @@ bool needRotatedPackedGreensFile=false;
 unsigned pixelScaleCalcMinX,pixelScaleCalcMinY;
 unsigned pixelScaleCalcMaxX,pixelScaleCalcMaxY;
 float pixelScale=1;
+enum class StreamFormat
+{
+    None,
+    PPM,      // binary 8-bit RGB
+    PPM16,    // binary 16-bit RGB
+    PAM,      // 8-bit RGB
+    Y4M,      // 8-bit BT.601 limited-range Y'CbCr 4:4:4, a single-frame stream
+    Y4MFrame, // the same frame without the stream header, to append to a Y4M stream
+} streamFormat=StreamFormat::None;
+float scalePercentile=0; // 0 to scale to the maximum
+std::string scaleSketchPath;
+std::string scaleSketchSource; // identifies the input image in the scale sketch
 std::string filePathPrefix="/tmp/outfile-";
 
 inline int usage(const char* argv0, int returnValue)
@@ -48,7 +75,13 @@ inline int usage(const char* argv0, int returnValue)
         {{"--combined"},            "Create a file containing RGGB data on the Bayer grid, coded by sRGB colors"},
         {{"--tiff"},                "Create a floating-point TIFF RGB file containing merged RGGB data from the Bayer grid, with green being average of the two Bayer values. Color space is sRGB-linear, values are normalized to maximum possible value of the raw file (taken from libRaw)."},
         {{"--tiff-unw"},            "Same as --tiff, but without applying cam_rgb matrix and without white balancing - only averaging the two Bayer green channels."},
-        {{"--f32"},                 "Save as floating-point single-component texture with header being uint16 width & height"},
+        {{"--png16"},               "Create a 16-bit PNG file with the merged sRGB image, like -srgb, gamma-encoded unless --linear16 is given"},
+        {{"--tiff16"},              "Create a 16-bit TIFF file with the merged sRGB image, like -srgb, gamma-encoded unless --linear16 is given"},
+        {{"--ppm16"},               "Create a 16-bit PPM file with the merged sRGB image, like -srgb, gamma-encoded unless --linear16 is given"},
+        {{"--linear16"},            "Make the 16-bit outputs linear instead of gamma-encoded"},
+        {{"--f32"},                 "Save as floating-point single-component texture with header being uint16 width & height (or, if either exceeds 65535, zeros followed by uint32 width & height)"},
+        {{"--npy"},                 "Save the same data as --f32 to a NumPy .npy file"},
+        {{"--npy-planes"},          "Save raw uint16 values of the four CFA channels, in R, G1, B, G2 order, to a NumPy .npy file of shape (4, height/2, width/2)"},
         {{"-r","--red"},            "Create a file with red channel only data on the Bayer grid"},
         {{"-g1","--green1"},        "Create a file with data only from first green channel on the Bayer grid"},
         {{"-g2","--green2"},        "Create a file with data only from second green channel on the Bayer grid"},
@@ -63,6 +96,16 @@ inline int usage(const char* argv0, int returnValue)
                                     "Scale pixel values by factor R"},
         {{"-sm","--scale-to-max-srgb"},  "WxH+X+Y",
                                     "Scale pixel values so that largest non-overexposed subpixel value in the range WxH+X+Y became 1.0 (or 255) in the output file"},
+        {{"-sp","--scale-percentile"},   "P",
+                                    "Scale pixel values so that the P-th percentile of the largest subpixel values of non-overexposed pixels became 1.0 (or 255), which, unlike the maximum, isn't thrown off by a few hot pixels. The range is the one given by --scale-to-max-srgb, or the whole image. Can't be combined with --scale."},
+        {{"--scale-sketch"},        "FILE",
+                                    "Add the values used by --scale-percentile to the sketch of their distribution kept in FILE, and take the percentile from all the values in it. Processing a sequence of images with the same FILE keeps their scales consistent; a second pass over the sequence gives all of them the same scale. The paths of the images are kept in FILE too, so an image processed again isn't counted twice."},
+        {{"--crop"},                "WxH+X+Y",
+                                    "Process only the region of W×H photosites at (X,Y) of the visible area. All outputs and the ranges of the scaling options are then relative to this region."},
+        {{"--downscale"},           "N",
+                                    "Average boxes of N×N quads of the CFA (2N×2N photosites) before any other processing, e.g. to make quick previews. All outputs and the ranges of the scaling options are then relative to the downscaled image."},
+        {{"--stdout"},              "{ppm|ppm16|pam|y4m|y4m-frame}",
+                                    "Stream the merged sRGB image to standard output in the format specified, top row first and row by row as it's converted. 'ppm' and 'pam' have the same values as --srgb writes, 'ppm16' the same as --ppm16, and 'y4m' is converted from the --srgb values. 'y4m-frame' omits the stream header, so that the frames of a sequence can follow a single 'y4m' one, e.g. for ffmpeg. Can't be combined with --f32, --npy or --npy-planes."},
         {{"-p","--prefix"},         "PATH",
                                     "Use PATH as file path prefix instead of \"outfile-\""},
         {{"-wb","--white-balance"}, "{as-shot|daylight|none}",
@@ -87,29 +130,119 @@ bool parseMatrix(float* data, const unsigned size, std::string const& line)
     return true;
 }
 
-void writeF32(LibRaw& libRaw, ushort (*img)[4], const uint16_t w, const uint16_t h, const unsigned blackLevel)
+using Planes=CFAPlanes<ushort>;
+
+// Converts rows of the array with fillRow(y, rowData) into chunks of a few megabytes and writes each
+// chunk at once, so that dumping a frame is limited by the disk rather than by the calls to write.
+template<typename Value, typename FillRow>
+void writeRows(std::ofstream& file, const std::size_t rowLength, const std::size_t rowCount, FillRow&& fillRow)
 {
-    const auto filename=filePathPrefix+".f32";
-    std::cerr << "Writing float32 data to file...";
-    std::ofstream file(filename, std::ios::binary);
-    file.write(reinterpret_cast<const char*>(&w), sizeof w);
-    file.write(reinterpret_cast<const char*>(&h), sizeof h);
-    for(int y=0;y<h;++y)
+    constexpr std::size_t CHUNK_SIZE=8<<20;
+    const auto rowsPerChunk=std::max<std::size_t>(1, CHUNK_SIZE/(rowLength*sizeof(Value)));
+    std::vector<Value> chunk(rowsPerChunk*rowLength);
+    for(std::size_t y=0;y<rowCount && file;y+=rowsPerChunk)
     {
-        for(int x=0;x<w;++x)
+        const auto rows=std::min(rowsPerChunk, rowCount-y);
+        dispatchISA([&]
         {
-            const auto colIndex=libRaw.FC(y,x);
-            const float pixelRaw=img[x+y*w][colIndex];
-            const float pixel=pixelRaw-blackLevel;
-            file.write(reinterpret_cast<const char*>(&pixel), sizeof pixel);
-        }
+            for(std::size_t n=0;n<rows;++n)
+                fillRow(y+n, chunk.data()+n*rowLength);
+        });
+        file.write(reinterpret_cast<const char*>(chunk.data()), rows*rowLength*sizeof(Value));
     }
+}
+
+// Fills a row of the CFA mosaic the planes were split from, as cropped and downscaled, with black level subtracted
+void fillMosaicRow(Planes const& planes, CFALayout const& layout, const float blackLevel,
+                   const std::size_t y, float*__restrict const line)
+{
+    const auto*__restrict const rowEven=planes.row(layout.channels[y%2][0],y/2);
+    const auto*__restrict const rowOdd =planes.row(layout.channels[y%2][1],y/2);
+    for(int x=0;x<planes.width();++x)
+    {
+        line[2*x+0]=float(rowEven[x])-blackLevel;
+        line[2*x+1]=float(rowOdd [x])-blackLevel;
+    }
+}
+
+void reportWritten(std::ofstream& file, std::string const& filename)
+{
     if(file.flush())
         std::cerr << " written to \"" << filename << "\"\n";
     else
         std::cerr << " failed to write to \"" << filename << "\"\n";
 }
 
+// The header is uint16 width & height, or, for larger images, zeros followed by uint32 width & height
+void writeF32(Planes const& planes, CFALayout const& layout, const unsigned blackLevel)
+{
+    const uint32_t w=2*planes.width(), h=2*planes.height();
+    const auto filename=filePathPrefix+".f32";
+    std::cerr << "Writing float32 data to file...";
+    std::ofstream file(filename, std::ios::binary);
+    if(w<=UINT16_MAX && h<=UINT16_MAX)
+    {
+        const uint16_t sizes[2]={uint16_t(w),uint16_t(h)};
+        file.write(reinterpret_cast<const char*>(sizes), sizeof sizes);
+    }
+    else
+    {
+        const uint16_t zeros[2]={};
+        const uint32_t sizes[2]={w,h};
+        file.write(reinterpret_cast<const char*>(zeros), sizeof zeros);
+        file.write(reinterpret_cast<const char*>(sizes), sizeof sizes);
+    }
+    writeRows<float>(file, w, h, [&](const std::size_t y, float*const line)
+                     { fillMosaicRow(planes, layout, blackLevel, y, line); });
+    reportWritten(file, filename);
+}
+
+// Writes the header of a NumPy .npy file of a little-endian C-ordered array
+void writeNPYHeader(std::ofstream& file, const char* dtype, std::vector<std::size_t> const& shape)
+{
+    std::ostringstream dict;
+    dict << "{'descr': '" << dtype << "', 'fortran_order': False, 'shape': (";
+    for(const auto size : shape)
+        dict << size << (shape.size()==1 ? ",), }" : ", ");
+    if(shape.size()!=1)
+        dict.seekp(-2,dict.cur) << "), }";
+    auto header=dict.str();
+    // Magic, version 1.0 and header length take 10 bytes, and the data must start at a multiple of 64
+    constexpr std::size_t preambleSize=10, alignment=64;
+    header.resize((preambleSize+header.size()+1+alignment-1)/alignment*alignment-preambleSize-1, ' ');
+    header+='\n';
+    const uint16_t headerSize=header.size();
+    file.write("\x93NUMPY\x01\x00", 8);
+    file.write(reinterpret_cast<const char*>(&headerSize), sizeof headerSize);
+    file.write(header.data(), header.size());
+}
+
+// Same data as the .f32 file: the CFA mosaic as float32 minus black level, shaped (height, width)
+void writeMosaicNPY(Planes const& planes, CFALayout const& layout, const unsigned blackLevel)
+{
+    const std::size_t w=2*planes.width(), h=2*planes.height();
+    const auto filename=filePathPrefix+"mosaic.npy";
+    std::cerr << "Writing float32 CFA mosaic to NumPy file...";
+    std::ofstream file(filename, std::ios::binary);
+    writeNPYHeader(file, "<f4", {h,w});
+    writeRows<float>(file, w, h, [&](const std::size_t y, float*const line)
+                     { fillMosaicRow(planes, layout, blackLevel, y, line); });
+    reportWritten(file, filename);
+}
+
+// Raw uint16 values of each CFA channel, shaped (4, height, width) in quads, channels in R, G1, B, G2 order
+void writePlanesNPY(Planes const& planes)
+{
+    const std::size_t w=planes.width(), h=planes.height();
+    const auto filename=filePathPrefix+"planes.npy";
+    std::cerr << "Writing uint16 CFA channel planes to NumPy file...";
+    std::ofstream file(filename, std::ios::binary);
+    writeNPYHeader(file, "<u2", {Planes::ChannelCount,h,w});
+    writeRows<uint16_t>(file, w, Planes::ChannelCount*h, [&](const std::size_t y, uint16_t*const line)
+                        { std::copy_n(planes.row(y/h,y%h), w, line); });
+    reportWritten(file, filename);
+}
+
 #pragma pack(push,1)
 struct BitmapHeader
 {
@@ -162,10 +295,240 @@ public:
     const char* data() const { return reinterpret_cast<const char*>(bytes.data()); }
 };
 
+using ValueLUT=ChannelLUT<float>;
+
+// A row of quads with black level subtracted
+struct QuadRow
+{
+    std::vector<float> channels[4]; // by LibRaw channel: R, G1, B, G2
+    std::vector<uint8_t> overexposed; // only set if the values are clipped
+    explicit QuadRow(const int width)
+        : channels{std::vector<float>(width),std::vector<float>(width),std::vector<float>(width),std::vector<float>(width)}
+        , overexposed(width)
+    {
+    }
+};
+
+// Looks up the values of the quads of a row. With ClipWhite, the quads that have
+// any photosite near white level are marked overexposed.
+template<bool ClipWhite>
+void readQuadRow(Planes const& planes, const int y, ValueLUT const& values, const unsigned white, QuadRow& row)
+{
+    const int width=planes.width();
+    for(int channel=0;channel<Planes::ChannelCount;++channel)
+        values.apply(channel, planes.row(channel,y), row.channels[channel].data(), width);
+    if constexpr(ClipWhite)
+    {
+        dispatchISA([&]
+        {
+            auto*const overexposed=row.overexposed.data();
+            std::fill(overexposed, overexposed+width, 0);
+            for(int channel=0;channel<Planes::ChannelCount;++channel)
+            {
+                const auto*const in=planes.row(channel,y);
+                for(int x=0;x<width;++x)
+                    overexposed[x] |= in[x]>white-10;
+            }
+        });
+    }
+}
+
+// Sketches the largest sRGB-linear component of the non-overexposed quads in the range, which is in quads.
+// The percentiles don't need every row, so only some are sampled, and these are dealt out to threads.
+QuantileSketch sketchSRGBMaxima(Planes const& planes, ValueLUT const& values, const unsigned white,
+                                libraw_colordata_t const& colorData, const int xBegin, const int yBegin,
+                                const int xEnd, const int yEnd)
+{
+    enum {BAYER_RED,BAYER_GREEN1,BAYER_BLUE,BAYER_GREEN2};
+    // Enough for the 99.9th percentile of even a narrow range to be backed by plenty of values
+    constexpr int MAX_SAMPLED_ROWS=512;
+    const QuadRowSample sample{std::max(1,(yEnd-yBegin)/MAX_SAMPLED_ROWS)};
+    const int rowStep=sample.exact() ? 1 : sample.step;
+    const int threadCount=std::max(1u,std::thread::hardware_concurrency());
+    std::vector<QuantileSketch> sketches(threadCount);
+    std::vector<std::thread> threads;
+    for(int n=0;n<threadCount;++n)
+    {
+        threads.emplace_back([&,n]
+        {
+            const auto& cam2srgb=colorData.rgb_cam;
+            QuadRow quads(planes.width());
+            for(int y=yBegin+sample.first(0)+n*rowStep;y<yEnd;y+=threadCount*rowStep)
+            {
+                readQuadRow<true>(planes, y, values, white, quads);
+                for(int x=xBegin;x<xEnd;++x)
+                {
+                    if(quads.overexposed[x])
+                        continue;
+                    const auto red = quads.channels[BAYER_RED][x];
+                    const auto green=(quads.channels[BAYER_GREEN1][x]+quads.channels[BAYER_GREEN2][x])/2.;
+                    const auto blue = quads.channels[BAYER_BLUE][x];
+                    const auto srgblR=cam2srgb[0][0]*red+cam2srgb[0][1]*green+cam2srgb[0][2]*blue;
+                    const auto srgblG=cam2srgb[1][0]*red+cam2srgb[1][1]*green+cam2srgb[1][2]*blue;
+                    const auto srgblB=cam2srgb[2][0]*red+cam2srgb[2][1]*green+cam2srgb[2][2]*blue;
+                    sketches[n].add(std::max({srgblR,srgblG,srgblB}));
+                }
+            }
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    for(int n=1;n<threadCount;++n)
+        sketches[0].merge(sketches[n]);
+    return sketches[0];
+}
+
 float clampRGB(float x){return std::max(0.f,std::min(1.f,x));}
 float toSRGB(float x){return std::pow(x,1/2.2f)*255;}
-void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const int h, const float (&rgbCoefs)[4], libraw_colordata_t const& colorData, unsigned whiteLevel)
+// The 8-bit code of a black-subtracted value, scaled by pixelScale, as in the BMP files
+uint8_t toSRGB8(const float p, const unsigned black, const unsigned white)
+{
+    return toSRGB(clampRGB(pixelScale*p/(white-black)));
+}
+
+// Gamma encoding of linear values in [0,1] into 16 bits by a table lookup. Linear values are quantized
+// finer than 16 bits, so that the table covers the steep part of the curve near black well enough.
+class Encoder16
+{
+    static constexpr int LEVELS=1<<20;
+    std::vector<uint16_t> table;
+public:
+    Encoder16()
+        : table(LEVELS)
+    {
+        for(int n=0;n<LEVELS;++n)
+            table[n]=std::lround(65535*std::pow(double(n)/(LEVELS-1),1/2.2));
+    }
+    uint16_t operator()(const float x) const { return table[int(clampRGB(x)*(LEVELS-1)+0.5f)]; }
+};
+uint16_t toLinear16(const float x){return clampRGB(x)*65535+0.5f;}
+
+// The image is planar, as CImg keeps it
+void writePPM16(const uint16_t* image, const int w, const int h, std::string const& filename)
+{
+    std::ofstream file(filename, std::ios::binary);
+    file << "P6\n" << w << ' ' << h << "\n65535\n";
+    const std::size_t planeSize=std::size_t(w)*h;
+    std::vector<uint8_t> line(6*w);
+    for(int y=0;y<h;++y)
+    {
+        const auto*const row=image+std::size_t(y)*w;
+        for(int x=0;x<w;++x)
+        {
+            for(int c=0;c<3;++c)
+            {
+                const auto v=row[c*planeSize+x];
+                line[6*x+2*c+0]=v>>8; // PPM is big-endian
+                line[6*x+2*c+1]=v&0xff;
+            }
+        }
+        file.write(reinterpret_cast<const char*>(line.data()), line.size());
+    }
+    if(file.flush())
+        std::cerr << " written to \"" << filename << "\"\n";
+    else
+        std::cerr << " failed to write to \"" << filename << "\"\n";
+}
+
+// Writes the merged sRGB image to stdout in streamFormat, converting and writing it a row at a time.
+// Y4M frames are planar, so there the chroma planes are kept until the luma is written. This is a pass
+// of its own, since the BMP files are written bottom-up, while the stream must go top-down.
+void streamSRGB(Planes const& planes, ValueLUT const& clippedValues, const unsigned black, const unsigned white,
+                libraw_colordata_t const& colorData)
+{
+    enum {BAYER_RED,BAYER_GREEN1,BAYER_BLUE,BAYER_GREEN2};
+    const int w=planes.width(), h=planes.height();
+    std::cerr << "Streaming merged sRGB image to standard output...";
+    auto& out=std::cout;
+    switch(streamFormat)
+    {
+    case StreamFormat::None:
+        return;
+    case StreamFormat::PPM:
+        out << "P6\n" << w << ' ' << h << "\n255\n";
+        break;
+    case StreamFormat::PPM16:
+        out << "P6\n" << w << ' ' << h << "\n65535\n";
+        break;
+    case StreamFormat::PAM:
+        out << "P7\nWIDTH " << w << "\nHEIGHT " << h << "\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n";
+        break;
+    case StreamFormat::Y4M:
+        out << "YUV4MPEG2 W" << w << " H" << h << " F25:1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n";
+        [[fallthrough]];
+    case StreamFormat::Y4MFrame:
+        out << "FRAME\n";
+        break;
+    }
+
+    const bool y4m = streamFormat==StreamFormat::Y4M || streamFormat==StreamFormat::Y4MFrame;
+    const int bytesPerSample = streamFormat==StreamFormat::PPM16 ? 2 : 1;
+    std::vector<uint8_t> line(w*3*bytesPerSample);
+    std::vector<uint8_t> chroma(y4m ? 2*std::size_t(w)*h : 0);
+    const auto& cam2srgb=colorData.rgb_cam;
+    // The values are computed as for the files, so that the 8-bit formats are byte-identical
+    // to --srgb, and 16-bit ones to --ppm16
+    std::optional<Encoder16> encode16;
+    if(bytesPerSample==2 && !linear16)
+        encode16.emplace();
+    const float scale16=pixelScale/(white-black);
+    QuadRow quads(w);
+    for(int y=0;y<h;++y)
+    {
+        readQuadRow<true>(planes, y, clippedValues, white, quads);
+        for(int x=0;x<w;++x)
+        {
+            const bool overexposed=quads.overexposed[x];
+            const auto red = quads.channels[BAYER_RED][x];
+            const auto green=(quads.channels[BAYER_GREEN1][x]+quads.channels[BAYER_GREEN2][x])/2.;
+            const auto blue = quads.channels[BAYER_BLUE][x];
+            const auto srgblR=cam2srgb[0][0]*red+cam2srgb[0][1]*green+cam2srgb[0][2]*blue;
+            const auto srgblG=cam2srgb[1][0]*red+cam2srgb[1][1]*green+cam2srgb[1][2]*blue;
+            const auto srgblB=cam2srgb[2][0]*red+cam2srgb[2][1]*green+cam2srgb[2][2]*blue;
+            const float srgbl[3]={float(srgblR),float(srgblG),float(srgblB)};
+            if(bytesPerSample==2)
+            {
+                for(int c=0;c<3;++c)
+                {
+                    const auto v=overexposed ? 1.f : scale16*srgbl[c];
+                    const uint16_t value = linear16 ? toLinear16(v) : (*encode16)(v);
+                    line[6*x+2*c+0]=value>>8; // PPM is big-endian
+                    line[6*x+2*c+1]=value&0xff;
+                }
+                continue;
+            }
+
+            // Overexposed pixels are white as in the BMP files
+            uint8_t rgb8[3];
+            for(int c=0;c<3;++c)
+                rgb8[c] = overexposed ? 255 : toSRGB8(srgbl[c], black, white);
+            if(y4m)
+            {
+                const float rgb[3]={rgb8[0]/255.f, rgb8[1]/255.f, rgb8[2]/255.f};
+                const auto Y = 0.299f*rgb[0]+0.587f*rgb[1]+0.114f*rgb[2];
+                line[x] = std::lround(16+219*Y);
+                chroma[std::size_t(y)*w+x]   = std::lround(128+224*(rgb[2]-Y)/1.772f);
+                chroma[std::size_t(h+y)*w+x] = std::lround(128+224*(rgb[0]-Y)/1.402f);
+            }
+            else
+            {
+                std::copy_n(rgb8, 3, &line[3*x]);
+            }
+        }
+        out.write(reinterpret_cast<const char*>(line.data()), y4m ? w : line.size());
+    }
+    if(y4m)
+        out.write(reinterpret_cast<const char*>(chroma.data()), chroma.size());
+    if(out.flush())
+        std::cerr << " done\n";
+    else
+        std::cerr << " failed\n";
+}
+template<typename Layout>
+void writeImagePlanesToBMP(Planes const& planes, const float (&rgbCoefs)[4], libraw_colordata_t const& colorData, unsigned whiteLevel)
 {
+    // Only complete quads are output
+    const int w=2*planes.width(), h=2*planes.height();
     enum {BAYER_RED,BAYER_GREEN1,BAYER_BLUE,BAYER_GREEN2};
     const unsigned black=colorData.black, white=whiteLevel;
     BitmapHeader header={};
@@ -180,7 +543,7 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
 
     const auto col=[black,white](float p)->uint8_t
         {
-            return toSRGB(clampRGB(pixelScale*p/(white-black)));
+            return toSRGB8(p,black,white);
         };
     const auto alignScanLine=[](ByteBuffer& bytes)
     {
@@ -189,43 +552,68 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
         const auto alignSize=(sizeof header-bytes.tellp())%scanLineAlignment;
         bytes.write(align,alignSize);
     };
-    const auto clampAndSubB=[black,white](ushort p, bool& overexposed)
-        {return (p>white-10 ? overexposed=true,white : p<black ? black : p)-black; };
-    const auto rgbCoefR =rgbCoefs[0];
-    const auto rgbCoefG1=rgbCoefs[1];
-    const auto rgbCoefB =rgbCoefs[2];
-    const auto rgbCoefG2=rgbCoefs[3];
-
-    if(pixelScale<0)
+    const auto clampAndSubB=[black,white](ushort p)
+        {return (p>white-10 ? white : p<black ? black : p)-black; };
+    const ValueLUT clippedValues([&](const int channel, const ushort p){ return rgbCoefs[channel]*clampAndSubB(p); });
+    if(pixelScale<0 && scalePercentile>0)
+    {
+        auto sketch=sketchSRGBMaxima(planes, clippedValues, white, colorData, pixelScaleCalcMinX, pixelScaleCalcMinY,
+                                     std::min<unsigned>(pixelScaleCalcMaxX,w/2), std::min<unsigned>(pixelScaleCalcMaxY,h/2));
+        if(!scaleSketchPath.empty())
+        {
+            // An unusable file is left alone rather than overwritten. Images already in the sketch,
+            // e.g. on another pass over a sequence, aren't merged again, so their values aren't counted twice.
+            QuantileSketch sequenceSketch(sketch.accuracy());
+            const bool exists=bool(std::ifstream(scaleSketchPath));
+            if(exists && !(sequenceSketch.load(scaleSketchPath) && sequenceSketch.accuracy()==sketch.accuracy()))
+            {
+                std::cerr << "Warning: \"" << scaleSketchPath << "\" is not a compatible scale sketch, not using it\n";
+            }
+            else if(exists && sequenceSketch.hasSource(scaleSketchSource))
+            {
+                sketch=sequenceSketch;
+            }
+            else
+            {
+                sequenceSketch.merge(sketch);
+                sequenceSketch.addSource(scaleSketchSource);
+                if(!sequenceSketch.save(scaleSketchPath))
+                    std::cerr << "Warning: failed to save scale sketch to \"" << scaleSketchPath << "\"\n";
+                sketch=sequenceSketch;
+            }
+        }
+        const auto value=sketch.quantile(scalePercentile/100);
+        if(!(value>0))
+        {
+            std::cerr << "No non-overexposed pixels to compute pixel scale from, leaving it 1\n";
+            pixelScale=1;
+        }
+        else
+        {
+            pixelScale = (white-black)/value;
+            std::cerr << "Computed pixel scale: " << pixelScale << " from " << scalePercentile << "th percentile of "
+                      << sketch.count() << " values\n";
+        }
+    }
+    else if(pixelScale<0)
     {
         float max=0;
-        const auto col00=libRaw.COLOR(0,0), col01=libRaw.COLOR(0,1), col10=libRaw.COLOR(1,0), col11=libRaw.COLOR(1,1);
         const auto& cam2srgb = colorData.rgb_cam;
-        const int stride=w;
         if(pixelScaleCalcMaxX>w/2)
             pixelScaleCalcMaxX=w/2;
         if(pixelScaleCalcMaxY>h/2)
             pixelScaleCalcMaxY=h/2;
+        QuadRow quads(w/2);
         for(int y=pixelScaleCalcMinY;y<pixelScaleCalcMaxY;++y)
         {
+            readQuadRow<true>(planes, y, clippedValues, white, quads);
             for(int x=pixelScaleCalcMinX;x<pixelScaleCalcMaxX;++x)
             {
-                const auto X=x*2, Y=y*2;
-                bool overexposed=false;
-                const ushort pixelTopLeft    =rgbCoefR *clampAndSubB(data[X+0+(Y+0)*stride][col00],overexposed);
-                const ushort pixelTopRight   =rgbCoefG1*clampAndSubB(data[X+1+(Y+0)*stride][col01],overexposed);
-                const ushort pixelBottomLeft =rgbCoefG2*clampAndSubB(data[X+0+(Y+1)*stride][col10],overexposed);
-                const ushort pixelBottomRight=rgbCoefB *clampAndSubB(data[X+1+(Y+1)*stride][col11],overexposed);
-                ushort rgbg2[4];
-                rgbg2[col00]=pixelTopLeft;
-                rgbg2[col01]=pixelTopRight;
-                rgbg2[col10]=pixelBottomLeft;
-                rgbg2[col11]=pixelBottomRight;
-                const auto red = rgbg2[BAYER_RED];
-                const auto green=(rgbg2[BAYER_GREEN1]+rgbg2[BAYER_GREEN2])/2.;
-                const auto blue = rgbg2[BAYER_BLUE];
-                if(overexposed)
+                if(quads.overexposed[x])
                     continue;
+                const auto red = quads.channels[BAYER_RED][x];
+                const auto green=(quads.channels[BAYER_GREEN1][x]+quads.channels[BAYER_GREEN2][x])/2.;
+                const auto blue = quads.channels[BAYER_BLUE][x];
                 const auto srgblR=cam2srgb[0][0]*red+cam2srgb[0][1]*green+cam2srgb[0][2]*blue;
                 const auto srgblG=cam2srgb[1][0]*red+cam2srgb[1][1]*green+cam2srgb[1][2]*blue;
                 const auto srgblB=cam2srgb[2][0]*red+cam2srgb[2][1]*green+cam2srgb[2][2]*blue;
@@ -238,24 +626,34 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
         std::cerr << "Computed pixel scale: " << pixelScale << "\n";
     }
 
+    if(streamFormat!=StreamFormat::None)
+        streamSRGB(planes, clippedValues, black, white, colorData);
+
 #define WRITE_BMP_DATA_TO_FILE(ANNOTATION,FILENAME,BLUE,GREEN,RED)  \
     do {                                                            \
         std::cerr << ANNOTATION;                                    \
         ByteBuffer bytes(header.fileSize);                          \
         bytes.write(&header,sizeof header);                         \
+        const auto writePixel=[&](const int channel, const ushort raw) \
+        {                                                           \
+            const bool overexposed=raw>white-10;                    \
+            float pixels[4]={};                                     \
+            pixels[channel]=clippedValues(channel,raw);             \
+            const auto pixelR=pixels[0], pixelG1=pixels[1], pixelB=pixels[2], pixelG2=pixels[3]; \
+            const uint8_t vals[3]={overexposed?uint8_t(255):BLUE,   \
+                                   overexposed?uint8_t(255):GREEN,  \
+                                   overexposed?uint8_t(255):RED};   \
+            bytes.write(vals,sizeof vals);                          \
+        };                                                          \
         for(int y=0;y<h;++y)                                        \
         {                                                           \
-            for(int x=0;x<w;++x)                                    \
+            const int channelEven=Layout::channel(y,0), channelOdd=Layout::channel(y,1); \
+            const auto*const rowEven=planes.row(channelEven,y/2);   \
+            const auto*const rowOdd =planes.row(channelOdd ,y/2);   \
+            for(int x=0;x<w/2;++x)                                  \
             {                                                       \
-                bool overexposed=false;                             \
-                const auto pixelR =rgbCoefR *clampAndSubB(data[x+y*w][0],overexposed);    \
-                const auto pixelG1=rgbCoefG1*clampAndSubB(data[x+y*w][1],overexposed);    \
-                const auto pixelB =rgbCoefB *clampAndSubB(data[x+y*w][2],overexposed);    \
-                const auto pixelG2=rgbCoefG2*clampAndSubB(data[x+y*w][3],overexposed);    \
-                const uint8_t vals[3]={overexposed?uint8_t(255):BLUE,   \
-                                       overexposed?uint8_t(255):GREEN,  \
-                                       overexposed?uint8_t(255):RED};   \
-                bytes.write(vals,sizeof vals);                      \
+                writePixel(channelEven,rowEven[x]);                 \
+                writePixel(channelOdd ,rowOdd [x]);                 \
             }                                                       \
             alignScanLine(bytes);                                   \
         }                                                           \
@@ -264,32 +662,23 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
         std::cerr << " written to \"" << FILENAME << "\"\n";        \
     } while(0)
 
-#define WRITE_TIFF_DATA_TO_FILE(ANNOTATION,FILENAME,WIDTH,HEIGHT)                                                           \
+#define WRITE_TIFF_DATA_TO_FILE(ANNOTATION,FILENAME)                                                                        \
     do {                                                                                                                    \
         std::cerr << ANNOTATION;                                                                                            \
-        const int stride=WIDTH;                                                                                             \
-        const auto W=WIDTH/2, H=HEIGHT/2;                                                                                   \
+        const auto W=planes.width(), H=planes.height();                                                                     \
         cimg_library::CImg<float> image(W,H, 1,3);                                                                          \
         float* pixels=image.data();                                                                                         \
         const float identity[3][4]={{1,0,0,0},{0,1,0,0},{0,0,1,0}};                                                         \
-        const auto subBlack=[black](ushort p) {return (p<black ? black : p)-black; };                                       \
+        const ValueLUT values([&](const int channel, const ushort p){ return rgbCoefs[channel]*((p<black ? black : p)-black); });\
+        QuadRow quads(W);                                                                                                   \
         for(int y=0;y<H;++y)                                                                                                \
+        {                                                                                                                   \
+            readQuadRow<false>(planes, y, values, white, quads);                                                            \
             for(int x=0;x<W;++x)                                                                                            \
             {                                                                                                               \
-                const auto X=x*2, Y=y*2;                                                                                    \
-                const auto col00=libRaw.COLOR(0,0), col01=libRaw.COLOR(0,1), col10=libRaw.COLOR(1,0), col11=libRaw.COLOR(1,1);\
-                const ushort pixelTopLeft    =rgbCoefR *subBlack(data[X+0+(Y+0)*stride][col00]);                            \
-                const ushort pixelTopRight   =rgbCoefG1*subBlack(data[X+1+(Y+0)*stride][col01]);                            \
-                const ushort pixelBottomLeft =rgbCoefG2*subBlack(data[X+0+(Y+1)*stride][col10]);                            \
-                const ushort pixelBottomRight=rgbCoefB *subBlack(data[X+1+(Y+1)*stride][col11]);                            \
-                ushort rgbg2[4];                                                                                            \
-                rgbg2[col00]=pixelTopLeft;                                                                                  \
-                rgbg2[col01]=pixelTopRight;                                                                                 \
-                rgbg2[col10]=pixelBottomLeft;                                                                               \
-                rgbg2[col11]=pixelBottomRight;                                                                              \
-                const auto red = rgbg2[BAYER_RED];                                                                          \
-                const auto green=(rgbg2[BAYER_GREEN1]+rgbg2[BAYER_GREEN2])/2.;                                              \
-                const auto blue = rgbg2[BAYER_BLUE];                                                                        \
+                const auto red = quads.channels[BAYER_RED][x];                                                              \
+                const auto green=(quads.channels[BAYER_GREEN1][x]+quads.channels[BAYER_GREEN2][x])/2.;                      \
+                const auto blue = quads.channels[BAYER_BLUE][x];                                                            \
                 const auto& cam2srgb = needUnweightedTIFF ? identity : colorData.rgb_cam;                                   \
                 const auto srgblR=cam2srgb[0][0]*red+cam2srgb[0][1]*green+cam2srgb[0][2]*blue;                              \
                 const auto srgblG=cam2srgb[1][0]*red+cam2srgb[1][1]*green+cam2srgb[1][2]*blue;                              \
@@ -298,19 +687,20 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
                 pixels[W*H*1+(x+y*W)] = pixelScale*srgblG/(white-black);                                                    \
                 pixels[W*H*2+(x+y*W)] = pixelScale*srgblB/(white-black);                                                    \
             }                                                                                                               \
+        }                                                                                                                   \
         if(!image.save((FILENAME).c_str()))                                                                                 \
             std::cerr << "failed to save \"" << (FILENAME) << "\"\n";                                                       \
         else                                                                                                                \
             std::cerr << "written to \"" << (FILENAME) << "\"\n";                                                           \
     } while(0);
 
+    const bool need16BitFile=needPNG16 || needTIFF16 || needPPM16;
     if(needFakeSRGB || needTrueSRGB || needChromaOnlyFile ||
        needPackedRedFile || needPackedGreenFile || needPackedBlueFile ||
-       needRotatedPackedGreensFile)
+       needRotatedPackedGreensFile || need16BitFile)
     {
         std::cerr << "Writing merged-color sRGB image to file" << (needFakeSRGB && needTrueSRGB ? "s" : "") << "...";
 
-        const int stride=w;
         const int w_=w/2, h_=h/2;
         const int w=w_, h=h_;
         BitmapHeader header={};
@@ -362,25 +752,25 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
             bytes_rotGreen.write(&modifiedHeader,sizeof modifiedHeader);
         }
 
+        // The 16-bit outputs get the sRGB image of the same pass as the 8-bit ones
+        cimg_library::CImg<uint16_t> image16(need16BitFile ? w : 0, need16BitFile ? h : 0, 1, 3);
+        auto*const pixels16=image16.data();
+        std::optional<Encoder16> encode16;
+        if(need16BitFile && !linear16)
+            encode16.emplace();
+        const float scale16=pixelScale/(white-black);
+
+        QuadRow quads(w);
         for(int y=h-1;y>=0;--y)
         {
+            readQuadRow<true>(planes, y, clippedValues, white, quads);
             for(int x=0;x<w;++x)
             {
-                const auto X=x*2, Y=y*2;
-                bool overexposed=false;
-                const auto col00=libRaw.COLOR(0,0), col01=libRaw.COLOR(0,1), col10=libRaw.COLOR(1,0), col11=libRaw.COLOR(1,1);
-                const ushort pixelTopLeft    =rgbCoefR *clampAndSubB(data[X+0+(Y+0)*stride][col00],overexposed);
-                const ushort pixelTopRight   =rgbCoefG1*clampAndSubB(data[X+1+(Y+0)*stride][col01],overexposed);
-                const ushort pixelBottomLeft =rgbCoefG2*clampAndSubB(data[X+0+(Y+1)*stride][col10],overexposed);
-                const ushort pixelBottomRight=rgbCoefB *clampAndSubB(data[X+1+(Y+1)*stride][col11],overexposed);
-                ushort rgbg2[4];
-                rgbg2[col00]=pixelTopLeft;
-                rgbg2[col01]=pixelTopRight;
-                rgbg2[col10]=pixelBottomLeft;
-                rgbg2[col11]=pixelBottomRight;
-                const auto red = rgbg2[BAYER_RED];
-                const auto green=(rgbg2[BAYER_GREEN1]+rgbg2[BAYER_GREEN2])/2.;
-                const auto blue = rgbg2[BAYER_BLUE];
+                const bool overexposed=quads.overexposed[x];
+                const auto red = quads.channels[BAYER_RED][x];
+                const auto green1=quads.channels[BAYER_GREEN1][x], green2=quads.channels[BAYER_GREEN2][x];
+                const auto green=(green1+green2)/2.;
+                const auto blue = quads.channels[BAYER_BLUE][x];
                 const uint8_t vals[3]={overexposed?uint8_t(255):col(blue),
                                        overexposed?uint8_t(255):col(green),
                                        overexposed?uint8_t(255):col(red)};
@@ -397,8 +787,8 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
                 {
                     const auto g2offset=(h-1+x-y)*3+rotGreenStride*(x+y);
                     const auto g1offset=g2offset+3;
-                    bytes_rotGreen.writeAt(std::array<uint8_t,3>{0,col(pixelTopRight  ),0}.data(), 3, g1offset);
-                    bytes_rotGreen.writeAt(std::array<uint8_t,3>{0,col(pixelBottomLeft),0}.data(), 3, g2offset);
+                    bytes_rotGreen.writeAt(std::array<uint8_t,3>{0,col(green1),0}.data(), 3, g1offset);
+                    bytes_rotGreen.writeAt(std::array<uint8_t,3>{0,col(green2),0}.data(), 3, g2offset);
                 }
 
                 const auto& cam2srgb=colorData.rgb_cam;
@@ -410,6 +800,15 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
                                             overexposed?uint8_t(255):col(srgblR)};
                 if(needTrueSRGB)
                     bytes_sRGB.write(vals_sRGB,sizeof vals_sRGB);
+                if(need16BitFile)
+                {
+                    const float srgbl[3]={float(srgblR),float(srgblG),float(srgblB)};
+                    for(int c=0;c<3;++c)
+                    {
+                        const auto v=overexposed ? 1.f : scale16*srgbl[c];
+                        pixels16[std::size_t(w)*h*c+std::size_t(y)*w+x] = linear16 ? toLinear16(v) : (*encode16)(v);
+                    }
+                }
 
                 const auto chromaR=(white-black)*srgblR/(srgblR+srgblG+srgblB);
                 const auto chromaG=(white-black)*srgblG/(srgblR+srgblG+srgblB);
@@ -482,6 +881,32 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
             file.write(bytes_rotGreen.data(),bytes_rotGreen.size());
             std::cerr << " written to \"" << filename << "\"\n";
         }
+        const auto name16=filePathPrefix+(linear16 ? "merged-linear16" : "merged-srgb16");
+        if(needPNG16 || needTIFF16)
+        {
+            const auto save=[&](std::string const& filename, auto&& saveImage)
+            {
+                std::cerr << "Writing 16-bit merged sRGB image to file...";
+                try
+                {
+                    saveImage(filename.c_str());
+                    std::cerr << " written to \"" << filename << "\"\n";
+                }
+                catch(cimg_library::CImgException const&)
+                {
+                    std::cerr << " failed to save \"" << filename << "\"\n";
+                }
+            };
+            if(needPNG16)
+                save(name16+".png", [&](const char* filename){ image16.save_png(filename, 2); });
+            if(needTIFF16)
+                save(name16+".tiff", [&](const char* filename){ image16.save_tiff(filename); });
+        }
+        if(needPPM16)
+        {
+            std::cerr << "Writing 16-bit merged sRGB image to file...";
+            writePPM16(pixels16, w, h, name16+".ppm");
+        }
     }
     if(needCombinedFile)
         WRITE_BMP_DATA_TO_FILE("Writing combined-channel data to file...",
@@ -501,7 +926,7 @@ void writeImagePlanesToBMP(LibRaw& libRaw, ushort (*data)[4], const int w, const
         WRITE_BMP_DATA_TO_FILE("Writing green12 channels to file...",filePathPrefix+"Green12.bmp",col(0),col(pixelG1+pixelG2),col(0));
 
     if(needTIFFFile || needUnweightedTIFF)
-        WRITE_TIFF_DATA_TO_FILE("Writing combined-channel data to TIFF file...", filePathPrefix+"merged.tiff", w,h);
+        WRITE_TIFF_DATA_TO_FILE("Writing combined-channel data to TIFF file...", filePathPrefix+"merged.tiff");
 
 }
 
@@ -519,6 +944,9 @@ int main(int argc, char** argv)
     constexpr auto cam2sRGBsize=9;
     float cam2sRGB[cam2sRGBsize];
     bool customCam2sRGBmatrix=false;
+    bool explicitPixelScale=false;
+    int cropX=0, cropY=0, cropW=INT_MAX, cropH=INT_MAX;
+    int downscale=1;
     for(int i=1;i<argc;++i)
     {
         const std::string arg(argv[i]);
@@ -533,6 +961,12 @@ int main(int argc, char** argv)
             whiteBalance=WhiteBalance::None;
         }
         else if(arg=="--f32" || arg=="-f32") needF32=true;
+        else if(arg=="--png16") needPNG16=true;
+        else if(arg=="--tiff16") needTIFF16=true;
+        else if(arg=="--ppm16") needPPM16=true;
+        else if(arg=="--linear16") linear16=true;
+        else if(arg=="--npy") needMosaicNPY=true;
+        else if(arg=="--npy-planes") needPlanesNPY=true;
         else if(arg=="-r" || arg=="--red") needRedFile=true;
         else if(arg=="-g1" || arg=="--green1") needGreen1File=true;
         else if(arg=="-g2" || arg=="--green2") needGreen2File=true;
@@ -605,6 +1039,7 @@ int main(int argc, char** argv)
                 std::cerr << "Failed to parse pixel value multiplier\n";
                 return 1;
             }
+            explicitPixelScale=true;
         }
         else if(arg=="-sm" || arg=="--scale-to-max-srgb")
         {
@@ -627,6 +1062,88 @@ int main(int argc, char** argv)
             pixelScaleCalcMaxY=y+h;
             pixelScale=-1; // will need to calculate it from input image
         }
+        else if(arg=="--crop")
+        {
+            if(++i==argc)
+            {
+                std::cerr << "Option " << arg << " requires parameter\n";
+                return usage(argv[0],1);
+            }
+            char c;
+            if(sscanf(argv[i], "%dx%d+%d+%d%c", &cropW,&cropH,&cropX,&cropY,&c) != 4 ||
+               cropW<=0 || cropH<=0 || cropX<0 || cropY<0)
+            {
+                std::cerr << "Failed to parse crop rectangle\n";
+                return usage(argv[0],1);
+            }
+        }
+        else if(arg=="--downscale")
+        {
+            if(++i==argc)
+            {
+                std::cerr << "Option " << arg << " requires parameter\n";
+                return usage(argv[0],1);
+            }
+            const std::string arg(argv[i]);
+            std::size_t pos=0;
+            try { downscale=std::stoi(arg,&pos); } catch(...) {}
+            if(pos!=arg.length() || downscale<1)
+            {
+                std::cerr << "Downscale factor must be a positive integer\n";
+                return 1;
+            }
+        }
+        else if(arg=="-sp" || arg=="--scale-percentile")
+        {
+            if(++i==argc)
+            {
+                std::cerr << "Option " << arg << " requires parameter\n";
+                return usage(argv[0],1);
+            }
+            const std::string arg(argv[i]);
+            std::size_t pos=0;
+            try { scalePercentile=std::stof(arg,&pos); } catch(...) {}
+            if(pos!=arg.length() || !(scalePercentile>0 && scalePercentile<=100))
+            {
+                std::cerr << "Percentile must be a number in (0,100]\n";
+                return 1;
+            }
+            if(pixelScale>=0)
+            {
+                // The whole image, unless --scale-to-max-srgb restricts it
+                pixelScaleCalcMinX=pixelScaleCalcMinY=0;
+                pixelScaleCalcMaxX=pixelScaleCalcMaxY=UINT_MAX;
+                pixelScale=-1;
+            }
+        }
+        else if(arg=="--scale-sketch")
+        {
+            if(++i==argc)
+            {
+                std::cerr << "Option " << arg << " requires parameter\n";
+                return usage(argv[0],1);
+            }
+            scaleSketchPath=argv[i];
+        }
+        else if(arg=="--stdout")
+        {
+            if(++i==argc)
+            {
+                std::cerr << "Option " << arg << " requires parameter\n";
+                return usage(argv[0],1);
+            }
+            const std::string arg(argv[i]);
+            if(arg=="ppm") streamFormat=StreamFormat::PPM;
+            else if(arg=="ppm16") streamFormat=StreamFormat::PPM16;
+            else if(arg=="pam") streamFormat=StreamFormat::PAM;
+            else if(arg=="y4m") streamFormat=StreamFormat::Y4M;
+            else if(arg=="y4m-frame") streamFormat=StreamFormat::Y4MFrame;
+            else
+            {
+                std::cerr << "Unknown stream format \"" << arg << "\"\n";
+                return 1;
+            }
+        }
         else if(arg=="-p" || arg=="--prefix")
         {
             if(++i==argc)
@@ -644,10 +1161,27 @@ int main(int argc, char** argv)
         }
     }
     if(filename.empty()) return usage(argv[0],1);
+    if(explicitPixelScale && scalePercentile>0)
+    {
+        std::cerr << "Options --scale and --scale-percentile are mutually exclusive\n";
+        return 1;
+    }
+    if(streamFormat!=StreamFormat::None && (needF32 || needMosaicNPY || needPlanesNPY))
+    {
+        // The array dumps are written before the sRGB image is rendered, and end the run
+        std::cerr << "Option --stdout can't be combined with --f32, --npy or --npy-planes\n";
+        return 1;
+    }
+    if(!scaleSketchPath.empty())
+    {
+        // The same image reached by another path must be recognized as already sketched
+        std::error_code error;
+        const auto path=std::filesystem::weakly_canonical(filename, error);
+        scaleSketchSource = error ? filename : path.string();
+    }
 
     LibRaw libRaw;
     libRaw.open_file(filename.c_str());
-    const auto& sizes=libRaw.imgdata.sizes;
 
     std::cerr << "Unpacking raw data...\n";
     if(const auto error=libRaw.unpack())
@@ -656,8 +1190,18 @@ int main(int argc, char** argv)
         return 2;
     }
 
-    std::cerr << "Convering raw data to image...\n";
-    libRaw.raw2image();
+    const auto*const rawImage=libRaw.imgdata.rawdata.raw_image;
+    const auto layout=rawImageLayout(libRaw, cropX, cropY, cropW, cropH);
+    if(layout.width<2 || layout.height<2)
+    {
+        std::cerr << "Crop rectangle doesn't contain any complete CFA quad of the visible area\n";
+        return 1;
+    }
+    if(!rawImage)
+    {
+        std::cerr << "Only Bayer CFA is supported\n";
+        return 3;
+    }
     const auto& cam_mul=libRaw.imgdata.color.cam_mul;
     const auto& pre_mul=libRaw.imgdata.color.pre_mul;
     const float camMulMax=*std::max_element(std::begin(cam_mul),std::end(cam_mul));
@@ -678,17 +1222,52 @@ int main(int argc, char** argv)
     else if(whiteBalance==WhiteBalance::Default)
         whiteBalance=WhiteBalance::Daylight;
 
-    if(needF32)
+    // Cropping and downscaling happen first, so that nothing else pays for the full frame
+    std::cerr << "Splitting raw data into channel planes...\n";
+    auto planes=Planes::split(rawImage, layout);
+    if(downscale>1 && !planes.empty())
     {
-        writeF32(libRaw, libRaw.imgdata.image,sizes.iwidth,sizes.iheight, libRaw.imgdata.rawdata.color.black);
+        const unsigned whiteLevel=customWhiteLevel ? customWhiteLevel : libRaw.imgdata.rawdata.color.maximum;
+        if(planes.width()<downscale || planes.height()<downscale)
+        {
+            std::cerr << "Image is too small to downscale by " << downscale << "\n";
+            return 1;
+        }
+        std::cerr << "Downscaling by " << downscale << "...\n";
+        planes=planes.downscaled(downscale, whiteLevel-10);
     }
-    else
+
+    // Array dumps are for numeric analysis, so they exclude the image outputs
+    if(needF32 || needMosaicNPY || needPlanesNPY)
     {
-        writeImagePlanesToBMP(libRaw, libRaw.imgdata.image,sizes.iwidth,sizes.iheight,
+        if(planes.empty())
+        {
+            std::cerr << "Only Bayer CFA is supported\n";
+            return 3;
+        }
+        const unsigned black=libRaw.imgdata.rawdata.color.black;
+        if(needF32)
+            writeF32(planes, layout, black);
+        if(needMosaicNPY)
+            writeMosaicNPY(planes, layout, black);
+        if(needPlanesNPY)
+            writePlanesNPY(planes);
+        return 0;
+    }
+
+    // Everything that's constant for the image is resolved here, so the loops get specialized for it
+    const bool isBayer=!planes.empty() && dispatchBayerLayout(layout.channels, [&](auto bayer)
+    {
+        writeImagePlanesToBMP<decltype(bayer)>(planes,
                               whiteBalance==WhiteBalance::Daylight ? daylightWBCoefs :
                                whiteBalance==WhiteBalance::AsShot ? asShotWBCoefs :
                                 noWBCoefs,
                               libRaw.imgdata.rawdata.color,
                               customWhiteLevel ? customWhiteLevel : libRaw.imgdata.rawdata.color.maximum);
+    });
+    if(!isBayer)
+    {
+        std::cerr << "Only Bayer CFA is supported\n";
+        return 3;
     }
 }
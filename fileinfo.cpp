@@ -3,12 +3,16 @@
 #include <iostream>
 #include <iomanip>
 #include <cstddef>
+#include "cfa-planes.hpp"
+#include "cfa-sampling.hpp"
 
 using std::size_t;
 
 int usage(const char* argv0, int returnValue)
 {
-    std::cerr << "Usage: " << argv0 << " filename\n";
+    std::cerr << "Usage: " << argv0 << " [--sample N [--refine]] filename\n"
+                 "  --sample N   find min and max in only one of every N rows of 2×2 quads\n"
+                 "  --refine     after printing the sampled min and max, find the exact ones\n";
     return returnValue;
 }
 
@@ -64,40 +68,79 @@ void printArray(std::ostream& stream, T (&array)[N])
     }
 }
 
-std::pair<ushort,ushort> calcMinMax(LibRaw& libRaw, const ushort (*data)[4], const int w, const int h)
+std::pair<ushort,ushort> calcMinMax(CFAPlanes<ushort> const& planes)
 {
-    enum {BAYER_RED,BAYER_GREEN1,BAYER_BLUE,BAYER_GREEN2};
-    const auto col00=libRaw.COLOR(0,0), col01=libRaw.COLOR(0,1), col10=libRaw.COLOR(1,0), col11=libRaw.COLOR(1,1);
-    const int stride=w;
     ushort minPix=0xffff, maxPix=0;
-    for(int Y=0; Y<h; Y+=2)
+    dispatchISA([&]
     {
-        for(int X=0; X<w; X+=2)
+        for(int c=0; c<planes.ChannelCount; ++c)
         {
-            const ushort pixelTopLeft    =data[X+0+(Y+0)*stride][col00];
-            const ushort pixelTopRight   =data[X+1+(Y+0)*stride][col01];
-            const ushort pixelBottomLeft =data[X+0+(Y+1)*stride][col10];
-            const ushort pixelBottomRight=data[X+1+(Y+1)*stride][col11];
-            if(pixelTopLeft     < minPix) minPix = pixelTopLeft;
-            if(pixelTopRight    < minPix) minPix = pixelTopRight;
-            if(pixelBottomLeft  < minPix) minPix = pixelBottomLeft;
-            if(pixelBottomRight < minPix) minPix = pixelBottomRight;
-            if(pixelTopLeft     > maxPix) maxPix = pixelTopLeft;
-            if(pixelTopRight    > maxPix) maxPix = pixelTopRight;
-            if(pixelBottomLeft  > maxPix) maxPix = pixelBottomLeft;
-            if(pixelBottomRight > maxPix) maxPix = pixelBottomRight;
+            for(int y=0; y<planes.height(); ++y)
+            {
+                const auto*const row=planes.row(c,y);
+                for(int x=0; x<planes.width(); ++x)
+                {
+                    minPix=std::min(minPix,row[x]);
+                    maxPix=std::max(maxPix,row[x]);
+                }
+            }
         }
-    }
+    });
+    return {minPix,maxPix};
+}
+
+// Reads the sampled quad rows in place, so that the rest of the image is never touched
+std::pair<ushort,ushort> calcSampledMinMax(const ushort* rawImage, CFALayout const& layout, QuadRowSample const& sample)
+{
+    ushort minPix=0xffff, maxPix=0;
+    const int width=layout.width/2*2;
+    dispatchISA([&]
+    {
+        for(int quadRow=sample.first(0); quadRow<layout.height/2; quadRow+=sample.step)
+        {
+            for(int y=2*quadRow; y<2*quadRow+2; ++y)
+            {
+                const auto*const row=rawImage+std::size_t(layout.top+y)*layout.stride+layout.left;
+                for(int x=0; x<width; ++x)
+                {
+                    minPix=std::min(minPix,row[x]);
+                    maxPix=std::max(maxPix,row[x]);
+                }
+            }
+        }
+    });
     return {minPix,maxPix};
 }
 
 int main(int argc, char** argv)
 {
-    if(argc!=2)
+    std::string filename;
+    QuadRowSample sample;
+    bool refine=false;
+    for(int i=1;i<argc;++i)
+    {
+        const auto arg=std::string(argv[i]);
+        if(arg=="--sample")
+        {
+            if(++i>=argc || !(sample.step=parseSampleStep(argv[i])))
+            {
+                std::cerr << "Option " << arg << " requires a positive integer parameter\n";
+                return usage(argv[0],1);
+            }
+        }
+        else if(arg=="--refine")
+            refine=true;
+        else if(arg=="-h" || arg=="--help")
+            return usage(argv[0],0);
+        else if(filename.empty() && arg.substr(0,1)!="-")
+            filename=arg;
+        else
+            return usage(argv[0],1);
+    }
+    if(filename.empty())
         return usage(argv[0],1);
-    const char* filename=argv[1];
     LibRaw libRaw;
-    libRaw.open_file(filename);
+    libRaw.open_file(filename.c_str());
     const auto& sizes=libRaw.imgdata.sizes;
 
     std::cerr << "Unpacking raw data...\n";
@@ -108,7 +151,6 @@ int main(int argc, char** argv)
     }
 
     const auto& idata=libRaw.imgdata.idata;
-    libRaw.raw2image();
     std::cout << "Make: " << idata.make << "\n";
     std::cout << "Model: " << idata.model << "\n";
     std::cout << "Colors: " << idata.colors << "\n";
@@ -123,9 +165,30 @@ int main(int argc, char** argv)
     std::cout << "Margins{left: " << sizes.left_margin << ", top: " << sizes.top_margin << "}\n";
     std::cout << "iSize: " << sizes.iwidth << "×" << sizes.iheight << "\n";
     std::cout << "Pixel aspect: " << sizes.pixel_aspect << "\n";
-    const auto minMax = calcMinMax(libRaw, libRaw.imgdata.image, sizes.iwidth, sizes.iheight);
-    std::cout << "Black level: " << libRaw.imgdata.rawdata.color.black << ", actual min: " << minMax.first << "\n";
-    std::cout << "White level: " << libRaw.imgdata.rawdata.color.maximum << ", actual max: " << minMax.second << "\n";
+    const auto*const rawImage=libRaw.imgdata.rawdata.raw_image;
+    const auto layout=rawImageLayout(libRaw);
+    const bool isBayer=rawImage && dispatchBayerLayout(layout.channels, [](auto){});
+    sample=sample.limitedTo(layout.height/2);
+    if(isBayer && !sample.exact())
+    {
+        // Extremes of a sample only bound the actual ones, so there's no interval to give for them
+        const auto minMax = calcSampledMinMax(rawImage, layout, sample);
+        std::cout << "Sampled one of every " << sample.step << " quad rows: min " << minMax.first
+                  << " (actual min is not greater), max " << minMax.second << " (actual max is not less)\n";
+    }
+    // The planes are only needed for the exact extremes
+    const auto planes=isBayer && (sample.exact() || refine) ? CFAPlanes<ushort>::split(rawImage, layout) : CFAPlanes<ushort>{};
+    if(planes.empty())
+    {
+        std::cout << "Black level: " << libRaw.imgdata.rawdata.color.black << "\n";
+        std::cout << "White level: " << libRaw.imgdata.rawdata.color.maximum << "\n";
+    }
+    else
+    {
+        const auto minMax = calcMinMax(planes);
+        std::cout << "Black level: " << libRaw.imgdata.rawdata.color.black << ", actual min: " << minMax.first << "\n";
+        std::cout << "White level: " << libRaw.imgdata.rawdata.color.maximum << ", actual max: " << minMax.second << "\n";
+    }
 
     std::cout << "cmatrix:\n"; printMatrix(std::cout,libRaw.imgdata.rawdata.color.cmatrix);
     std::cout << "rgb_cam:\n"; printMatrix(std::cout,libRaw.imgdata.rawdata.color.rgb_cam);
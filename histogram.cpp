@@ -7,12 +7,17 @@
 #include <limits>
 #include <cassert>
 #include <cmath>
+#include <thread>
+#include "cfa-histogram.hpp"
+#include "cfa-planes.hpp"
 
 using std::size_t;
 
 inline int usage(const char* argv0, int returnValue)
 {
-    std::cerr << "Usage: " << argv0 << " [--mma|--csv] [--white-balance] [--no-clip] filename\n";
+    std::cerr << "Usage: " << argv0 << " [--mma|--csv] [--white-balance] [--no-clip] [--sample N [--refine]] filename\n"
+                 "  --sample N   bin only one of every N rows of 2×2 quads, for a quick estimate\n"
+                 "  --refine     after printing the sampled statistics, compute the exact histogram\n";
     return returnValue;
 }
 
@@ -63,93 +68,102 @@ void formatHistogram(std::vector<int> const& histogramRed,
     }
 }
 
-void printImageHistogram(LibRaw& libRaw, const ushort (*img)[4], const int w, const int h,
-                         const unsigned black, const unsigned white, const float (&rgbCoefs)[4],
-                         PrintFormat format, const bool clip)
+void printChannelStats(CFAHistogram const& hist)
 {
-    const auto rgbCoefR =rgbCoefs[0];
-    const auto rgbCoefG1=rgbCoefs[1];
-    const auto rgbCoefB =rgbCoefs[2];
-    const auto rgbCoefG2=rgbCoefs[3];
+    static const char*const names[CFAHistogram::ChannelCount] = {"red", "green-1", "blue", "green-2"};
+    for(int c=0; c<CFAHistogram::ChannelCount; ++c)
+    {
+        const auto& stats = hist.stats(c);
+        if(!stats.total) continue;
+        std::cerr << names[c] << ": min " << stats.min << ", max " << stats.max << ", mean " << stats.mean();
+        if(hist.sampled())
+            std::cerr << " ± " << hist.meanHalfWidth95(c);
+        std::cerr << ", percentiles 1%: " << hist.percentile(c, 0.01)
+                  << ", 50%: " << hist.percentile(c, 0.5)
+                  << ", 99%: " << hist.percentile(c, 0.99)
+                  << ", below black: " << stats.underflow
+                  << ", above white: " << stats.overflow << "\n";
+    }
+}
 
-    const auto histSize = clip ? white-black+1 : white;
-    std::vector<int> histogramRed(histSize);
-    std::vector<int> histogramGreen1(histSize);
-    std::vector<int> histogramGreen2(histSize);
-    std::vector<int> histogramBlue(histSize);
+void printImageHistogram(LibRaw& libRaw, const unsigned black, const unsigned white, const float (&rgbCoefs)[4],
+                         PrintFormat format, const bool clip, QuadRowSample const& sample, const bool refine)
+{
+    const auto layout=rawImageLayout(libRaw);
+
+    // A bin for each possible code value, so that the histogram can be remapped below without loss
+    const auto compute=[&](QuadRowSample const& rows)
+    {
+        return CFAHistogram::compute(libRaw.imgdata.rawdata.raw_image, layout,
+                                     {1<<16, 1.f, float(black), float(white), rows},
+                                     std::thread::hardware_concurrency());
+    };
     std::cerr << "Computing histogram...\n";
-    int tooBlackPixelCount=0, tooWhitePixelCount=0;
-    for(int y=0;y<h;++y)
+    auto hist=compute(sample.limitedTo(layout.height/2));
+    if(hist.sampled())
     {
-        for(int x=0;x<w;++x)
+        std::cerr << "Estimated from one of every " << sample.step << " quad rows, means with 95% confidence intervals:\n";
+        printChannelStats(hist);
+        if(refine)
         {
-            const auto colIndex=libRaw.FC(y,x);
-            auto pixelRaw=img[x+y*w][colIndex];
-            if(pixelRaw<black)
-            {
-                ++tooBlackPixelCount;
-                if(clip)
-                    pixelRaw=black;
-            }
-            else if(pixelRaw>white)
-            {
-                ++tooWhitePixelCount;
-                if(clip)
-                    pixelRaw=white;
-            }
+            std::cerr << "Refining to exact histogram...\n";
+            hist=compute({});
+        }
+    }
 
-            const auto pixel = clip ? pixelRaw-black : pixelRaw;
-            std::size_t index;
-            switch(colIndex)
-            {
-            case 0:
-                index = std::lround(pixel*rgbCoefR);
-                if(index>=histogramRed.size())
-                    histogramRed.resize(index+1);
-                ++histogramRed[index];
-                break;
-            case 1:
-                index = std::lround(pixel*rgbCoefG1);
-                if(index>=histogramGreen1.size())
-                    histogramGreen1.resize(index+1);
-                ++histogramGreen1[index];
-                break;
-            case 2:
-                index = std::lround(pixel*rgbCoefB);
-                if(index>=histogramBlue.size())
-                    histogramBlue.resize(index+1);
-                ++histogramBlue[index];
-                break;
-            case 3:
-                index = std::lround(pixel*rgbCoefG2);
-                if(index>=histogramGreen2.size())
-                    histogramGreen2.resize(index+1);
-                ++histogramGreen2[index];
-                break;
-            default: assert(!"Must not get here!");
-            }
+    // Counts of a sample are scaled to estimate those of the whole image, like the warnings below
+    const auto scale = hist.sampled() ? hist.params().sample.step : 1;
+    if(hist.sampled())
+        std::cerr << "Histogram counts are those of the sample multiplied by " << scale << "\n";
+    const auto histSize = clip ? white-black+1 : white;
+    std::vector<int> histograms[CFAHistogram::ChannelCount];
+    for(int c=0;c<CFAHistogram::ChannelCount;++c)
+    {
+        auto& histogram=histograms[c];
+        histogram.resize(histSize);
+        const auto*const counts=hist.counts(c);
+        for(unsigned pixelRaw=0;pixelRaw<1u<<16;++pixelRaw)
+        {
+            if(!counts[pixelRaw]) continue;
+            const auto pixelClipped = clip ? std::clamp(pixelRaw,black,white) : pixelRaw;
+            const auto pixel = clip ? pixelClipped-black : pixelClipped;
+            const std::size_t index = std::lround(pixel*rgbCoefs[c]);
+            if(index>=histogram.size())
+                histogram.resize(index+1);
+            histogram[index]+=counts[pixelRaw]*scale;
         }
     }
-    const auto maxLen = std::max({histogramRed.size(), histogramGreen1.size(), histogramGreen2.size(), histogramBlue.size()});
-    histogramRed.resize(maxLen);
-    histogramGreen1.resize(maxLen);
-    histogramGreen2.resize(maxLen);
-    histogramBlue.resize(maxLen);
+    const auto maxLen = std::max({histograms[0].size(), histograms[1].size(), histograms[2].size(), histograms[3].size()});
+    for(auto& histogram : histograms)
+        histogram.resize(maxLen);
+
+    std::uint64_t tooBlackPixelCount=0, tooWhitePixelCount=0;
+    for(int c=0;c<CFAHistogram::ChannelCount;++c)
+    {
+        tooBlackPixelCount+=hist.stats(c).underflow;
+        tooWhitePixelCount+=hist.stats(c).overflow;
+    }
+    const char*const about = hist.sampled() ? "about " : "";
     if(tooBlackPixelCount)
-        std::cerr << "Warning: " << tooBlackPixelCount << " pixels have values less than black level\n";
+        std::cerr << "Warning: " << about << tooBlackPixelCount*scale << " pixels have values less than black level\n";
     if(tooWhitePixelCount)
-        std::cerr << "Warning: " << tooWhitePixelCount << " pixels have values greater than white level\n";
-    formatHistogram(histogramRed,histogramGreen1,histogramGreen2,histogramBlue,format);
+        std::cerr << "Warning: " << about << tooWhitePixelCount*scale << " pixels have values greater than white level\n";
+    if(!hist.sampled()) // a sample's statistics have been printed above
+        printChannelStats(hist);
+    formatHistogram(histograms[CFAHistogram::Red],histograms[CFAHistogram::Green1],
+                    histograms[CFAHistogram::Green2],histograms[CFAHistogram::Blue],format);
 }
 
 int main(int argc, char** argv)
 {
-    if(argc<2 || argc>4)
+    if(argc<2)
         return usage(argv[0],1);
-    std::string filename=argv[1];
+    std::string filename;
     PrintFormat format=PrintFormat::CSV;
     bool enableWhiteBalance=false;
     bool clipping=true;
+    QuadRowSample sample;
+    bool refine=false;
     for(int i=1;i<argc;++i)
     {
         const auto arg=std::string(argv[i]);
@@ -169,6 +183,18 @@ int main(int argc, char** argv)
         {
             clipping=false;
         }
+        else if(arg=="--sample")
+        {
+            if(++i>=argc || !(sample.step=parseSampleStep(argv[i])))
+            {
+                std::cerr << "Option " << arg << " requires a positive integer parameter\n";
+                return usage(argv[0],1);
+            }
+        }
+        else if(arg=="--refine")
+        {
+            refine=true;
+        }
         else if(filename.empty() && !arg.empty() && arg[0]!='-')
         {
             filename=arg;
@@ -184,13 +210,15 @@ int main(int argc, char** argv)
         }
     }
 
+    if(filename.empty())
+        return usage(argv[0],1);
+
     if(enableWhiteBalance)
         std::cerr << "Will use camera-supplied \"as-shot\" white balance coefficients\n";
     else
         std::cerr << "Will print unbalanced raw histogram\n";
     LibRaw libRaw;
     libRaw.open_file(filename.c_str());
-    const auto& sizes=libRaw.imgdata.sizes;
 
     std::cerr << "Unpacking raw data...\n";
     if(const auto error=libRaw.unpack())
@@ -199,14 +227,16 @@ int main(int argc, char** argv)
         return 2;
     }
 
-    const auto& idata=libRaw.imgdata.idata;
+    if(!libRaw.imgdata.rawdata.raw_image)
+    {
+        std::cerr << "Raw data are not in Bayer CFA format\n";
+        return 2;
+    }
 
-    std::cerr << "Convering raw data to image...\n";
-    libRaw.raw2image();
     const auto& cam_mul=libRaw.imgdata.color.cam_mul;
     const float camMulMax=*std::max_element(std::begin(cam_mul),std::end(cam_mul));
     const float rgbCoefs[4]={cam_mul[0]/camMulMax,cam_mul[1]/camMulMax,cam_mul[2]/camMulMax,cam_mul[3]/camMulMax};
     const float ones[4]={1,1,1,1};
-    printImageHistogram(libRaw, libRaw.imgdata.image, sizes.iwidth,sizes.iheight, libRaw.imgdata.color.black,
-                        libRaw.imgdata.color.maximum, enableWhiteBalance ? rgbCoefs : ones,format, clipping);
+    printImageHistogram(libRaw, libRaw.imgdata.color.black, libRaw.imgdata.color.maximum,
+                        enableWhiteBalance ? rgbCoefs : ones,format, clipping, sample, refine);
 }
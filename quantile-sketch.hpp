@@ -0,0 +1,170 @@
+#ifndef INCLUDE_ONCE_2D5E0D76_3B70_4905_9F79_2B53F1024EA5
+#define INCLUDE_ONCE_2D5E0D76_3B70_4905_9F79_2B53F1024EA5
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <algorithm>
+
+// Streaming sketch of a distribution of values, answering quantile queries with
+// bounded relative error. Positive values are counted in logarithmic buckets,
+// each spanning a factor of (1+accuracy)/(1-accuracy), so any quantile is known
+// to within the relative accuracy, and memory grows only with the logarithm of
+// the ratio of the largest value to the smallest. Sketches with the same
+// accuracy merge exactly, so parts of an image, or a whole sequence of images,
+// can be sketched separately and combined. The names of the sources merged in
+// can be recorded, so that a source isn't counted twice.
+class QuantileSketch
+{
+public:
+    explicit QuantileSketch(const double relativeAccuracy=0.005)
+        : accuracy_(relativeAccuracy)
+        , invLogGamma_(1/std::log((1+relativeAccuracy)/(1-relativeAccuracy)))
+    {
+    }
+
+    double accuracy() const { return accuracy_; }
+    std::uint64_t count() const { return count_; }
+    // Names must not contain line breaks
+    void addSource(std::string const& name) { sources_.push_back(name); }
+    bool hasSource(std::string const& name) const
+    {
+        return std::find(sources_.begin(), sources_.end(), name) != sources_.end();
+    }
+
+    // Zero, negative and NaN values are counted as zeros
+    void add(const double value)
+    {
+        ++count_;
+        if(!(value>0))
+        {
+            ++zeroCount_;
+            return;
+        }
+        const int index = std::ceil(std::log(value)*invLogGamma_);
+        ++bucket(index);
+    }
+    // Returns false if the accuracies differ
+    bool merge(QuantileSketch const& other)
+    {
+        if(other.accuracy_!=accuracy_)
+            return false;
+        count_ += other.count_;
+        zeroCount_ += other.zeroCount_;
+        for(std::size_t n=0; n<other.buckets_.size(); ++n)
+        {
+            if(other.buckets_[n])
+                bucket(other.firstIndex_+int(n)) += other.buckets_[n];
+        }
+        for(const auto& name : other.sources_)
+        {
+            if(!hasSource(name))
+                sources_.push_back(name);
+        }
+        return true;
+    }
+
+    // Value below which the given fraction of the values lies, NaN if the sketch is empty
+    double quantile(const double fraction) const
+    {
+        if(!count_) return NAN;
+        const double rank = std::min(std::max(0., fraction), 1.)*(count_-1);
+        double cumulative = zeroCount_;
+        if(cumulative > rank)
+            return 0;
+        for(std::size_t n=0; n<buckets_.size(); ++n)
+        {
+            cumulative += buckets_[n];
+            if(cumulative > rank)
+                return bucketValue(firstIndex_+int(n));
+        }
+        return bucketValue(firstIndex_+int(buckets_.size())-1);
+    }
+
+    // A plain text format, so that the sketch of a sequence can be kept between runs
+    bool save(std::string const& path) const
+    {
+        std::ofstream file(path);
+        file.precision(17);
+        file << "quantile-sketch 1\n" << accuracy_ << ' ' << count_ << ' ' << zeroCount_ << ' '
+             << firstIndex_ << ' ' << buckets_.size() << '\n';
+        for(const auto count : buckets_)
+            file << count << '\n';
+        file << sources_.size() << '\n';
+        for(const auto& name : sources_)
+            file << name << '\n';
+        return bool(file.flush());
+    }
+    // Returns false if the file can't be read or isn't a sketch, leaving the object unchanged
+    bool load(std::string const& path)
+    {
+        std::ifstream file(path);
+        std::string magic;
+        int version=0;
+        double accuracy=0;
+        std::uint64_t count=0, zeroCount=0;
+        int firstIndex=0;
+        std::size_t size=0;
+        if(!(file >> magic >> version >> accuracy >> count >> zeroCount >> firstIndex >> size) ||
+           magic!="quantile-sketch" || version!=1 || !(accuracy>0 && accuracy<1))
+            return false;
+        std::vector<std::uint64_t> buckets(size);
+        for(auto& bucketCount : buckets)
+        {
+            if(!(file >> bucketCount))
+                return false;
+        }
+        std::size_t sourceCount=0;
+        if(!(file >> sourceCount) || !file.ignore(1))
+            return false;
+        std::vector<std::string> sources(sourceCount);
+        for(auto& name : sources)
+        {
+            if(!std::getline(file, name))
+                return false;
+        }
+        *this = QuantileSketch(accuracy);
+        sources_ = std::move(sources);
+        count_ = count;
+        zeroCount_ = zeroCount;
+        firstIndex_ = firstIndex;
+        buckets_ = std::move(buckets);
+        return true;
+    }
+
+private:
+    std::uint64_t& bucket(const int index)
+    {
+        if(buckets_.empty())
+            firstIndex_ = index;
+        if(index < firstIndex_)
+        {
+            buckets_.insert(buckets_.begin(), firstIndex_-index, 0);
+            firstIndex_ = index;
+        }
+        else if(index-firstIndex_ >= int(buckets_.size()))
+        {
+            buckets_.resize(index-firstIndex_+1);
+        }
+        return buckets_[index-firstIndex_];
+    }
+    // Midpoint of the bucket in the sense of relative error
+    double bucketValue(const int index) const
+    {
+        const double gamma = (1+accuracy_)/(1-accuracy_);
+        return 2*std::pow(gamma, index)/(gamma+1);
+    }
+
+private:
+    double accuracy_;
+    double invLogGamma_;
+    std::uint64_t count_=0;
+    std::uint64_t zeroCount_=0;
+    int firstIndex_=0;
+    std::vector<std::uint64_t> buckets_;
+    std::vector<std::string> sources_;
+};
+
+#endif
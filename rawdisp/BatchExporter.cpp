@@ -0,0 +1,219 @@
+#include "BatchExporter.hpp"
+#include <cmath>
+#include <algorithm>
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QImage>
+#include <QSettings>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QtConcurrent>
+#include "qoi.hpp"
+#include "srgb.hpp"
+#include "timing.hpp"
+
+BatchExporter::BatchExporter(QStringList const& files, QString const& outputDir, const Format format,
+                             Renderer renderer, QObject*const parent)
+    : QObject(parent)
+    , files_(files)
+    , outputDir_(outputDir)
+    , format_(format)
+    , renderer_(std::move(renderer))
+    , cancelled_(std::make_shared<FileLoader::CancelFlag>(false))
+{
+}
+
+BatchExporter::~BatchExporter()
+{
+    cancel();
+    pool_.waitForDone();
+}
+
+QString BatchExporter::extension(const Format format)
+{
+    switch(format)
+    {
+    case Format::PNG8:   return "png";
+    case Format::QOI:    return "qoi";
+    case Format::TIFF16: return "tif";
+    case Format::PFM:    return "pfm";
+    }
+    return {};
+}
+
+void BatchExporter::start()
+{
+    emit progress(0, files_.size());
+    if(files_.isEmpty())
+    {
+        emit finished();
+        return;
+    }
+    startLoading();
+}
+
+void BatchExporter::cancel()
+{
+    *cancelled_ = true;
+}
+
+void BatchExporter::startLoading()
+{
+    // Each file in flight holds its raw data or a float RGB image, so their number is limited by memory
+    const int maxInFlight = std::max(1, std::min(pool_.maxThreadCount(),
+                                                 QSettings().value("BatchExporter/maxFilesInFlight", 4).toInt()));
+    while(inFlight_ < maxInFlight && nextToLoad_ < files_.size() && !*cancelled_)
+    {
+        const int index = nextToLoad_++;
+        ++inFlight_;
+        const auto watcher = new QFutureWatcher<Loaded>(this);
+        connect(watcher, &QFutureWatcher<Loaded>::finished, this, [this,watcher,index]
+                {
+                    onLoaded(index, watcher->result());
+                    watcher->deleteLater();
+                });
+        watcher->setFuture(QtConcurrent::run(&pool_, [filename=files_[index],cancelled=cancelled_]
+        {
+            Loaded loaded{std::make_shared<LibRaw>(), LIBRAW_SUCCESS};
+            loaded.error = FileLoader::unpack(*loaded.libRaw, FileLoader::readFile(filename, *cancelled), *cancelled);
+            return loaded;
+        }));
+    }
+    if(inFlight_ == 0)
+        emit finished();
+}
+
+void BatchExporter::onLoaded(const int index, Loaded const& loaded)
+{
+    if(*cancelled_)
+    {
+        onWritten(index, {});
+        return;
+    }
+    if(loaded.error)
+    {
+        onWritten(index, tr("Failed to unpack file: %1").arg(libraw_strerror(loaded.error)));
+        return;
+    }
+
+    // Synchronous in the GUI thread, see the class comment
+    const auto t0 = currentTime();
+    auto image = std::make_shared<ExportImage>(renderer_(loaded.libRaw));
+    const auto t1 = currentTime();
+    qDebug().nospace() << "Image for export rendered in " << double(t1-t0) << " seconds";
+    if(image->data.empty())
+    {
+        onWritten(index, tr("Failed to render the image"));
+        return;
+    }
+
+    const auto path = QDir(outputDir_).filePath(QFileInfo(files_[index]).completeBaseName()+"."+extension(format_));
+    const auto watcher = new QFutureWatcher<QString>(this);
+    connect(watcher, &QFutureWatcher<QString>::finished, this, [this,watcher,index]
+            {
+                onWritten(index, watcher->result());
+                watcher->deleteLater();
+            });
+    watcher->setFuture(QtConcurrent::run(&pool_, [image,path,format=format_]{ return write(*image, path, format); }));
+}
+
+void BatchExporter::onWritten(const int index, QString const& error)
+{
+    if(!error.isEmpty())
+        emit fileFailed(files_[index], error);
+    --inFlight_;
+    ++done_;
+    emit progress(done_, files_.size());
+    startLoading();
+}
+
+QString BatchExporter::writePNG(QImage const& image, QString const& path)
+{
+    // Qt's PNG writer maps quality to zlib compression level, as 9 - quality*9/91 roughly.
+    // Low levels are much faster and lose little in size for noisy photographic data.
+    const int level = std::clamp(QSettings().value("BatchExporter/pngCompressionLevel", 1).toInt(), 0, 9);
+    QImageWriter writer(path, "png");
+    writer.setQuality(100 - (level*91+8)/9);
+    if(!writer.write(image))
+        return tr("Failed to write %1: %2").arg(path).arg(writer.errorString());
+    return {};
+}
+
+QString BatchExporter::writeQOI(QImage const& image, QString const& path)
+{
+    QFile file(path);
+    if(!file.open(QFile::WriteOnly))
+        return tr("Failed to open %1: %2").arg(path).arg(file.errorString());
+    const auto data = encodeQOI(image.constBits(), image.width(), image.height(), image.bytesPerLine());
+    if(file.write(data) != data.size())
+        return tr("Failed to write %1: %2").arg(path).arg(file.errorString());
+    return {};
+}
+
+QString BatchExporter::write(ExportImage const& image, QString const& path, const Format format)
+{
+    const auto t0 = currentTime();
+    const int W = image.width, H = image.height;
+    const auto& M = image.cam2srgb;
+    const auto pixel = [&](const int x, const int y, float*const srgb)
+    {
+        const float*const rgb = &image.data[3*(std::size_t(y)*W+x)];
+        for(int c = 0; c < 3; ++c)
+            srgb[c] = (M[c][0]*rgb[0] + M[c][1]*rgb[1] + M[c][2]*rgb[2]) * image.exposureCoef;
+    };
+    float matrix[3][3];
+    for(int i = 0; i < 3; ++i)
+        for(int j = 0; j < 3; ++j)
+            matrix[i][j] = M[i][j]*image.exposureCoef;
+
+    switch(format)
+    {
+    case Format::PNG8:
+    case Format::QOI:
+    {
+        QImage img(W, H, QImage::Format_RGB888);
+        linearToSRGB8(image.data.data(), 3, 3*std::size_t(W), W, H, false, matrix, img.bits(), img.bytesPerLine());
+        const auto error = format==Format::PNG8 ? writePNG(img, path) : writeQOI(img, path);
+        if(!error.isEmpty())
+            return error;
+        break;
+    }
+    case Format::TIFF16:
+    {
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+        QImage img(W, H, QImage::Format_RGBA64);
+        linearToSRGB16(image.data.data(), 3, 3*std::size_t(W), W, H, false, matrix,
+                       reinterpret_cast<std::uint16_t*>(img.bits()), img.bytesPerLine());
+        QImageWriter writer(path, "tiff");
+        if(!writer.write(img))
+            return tr("Failed to write %1: %2").arg(path).arg(writer.errorString());
+        break;
+#else
+        return tr("16-bit images require Qt 5.12 or newer");
+#endif
+    }
+    case Format::PFM:
+    {
+        QFile file(path);
+        if(!file.open(QFile::WriteOnly))
+            return tr("Failed to open %1: %2").arg(path).arg(file.errorString());
+        // Negative scale means little-endian data. Rows go from bottom to top.
+        const bool littleEndian = QSysInfo::ByteOrder == QSysInfo::LittleEndian;
+        file.write(QString("PF\n%1 %2\n%3\n").arg(W).arg(H).arg(littleEndian ? "-1" : "1").toLatin1());
+        std::vector<float> line(3*W);
+        for(int y = H-1; y >= 0; --y)
+        {
+            for(int x = 0; x < W; ++x)
+                pixel(x, y, &line[3*x]);
+            const qint64 size = line.size()*sizeof line[0];
+            if(file.write(reinterpret_cast<const char*>(line.data()), size) != size)
+                return tr("Failed to write %1: %2").arg(path).arg(file.errorString());
+        }
+        break;
+    }
+    }
+    const auto t1 = currentTime();
+    qDebug().nospace() << "Image written to " << path << " in " << double(t1-t0) << " seconds";
+    return {};
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <libraw/libraw.h>
+#include <QImage>
+#include <QObject>
+#include <QThreadPool>
+#include <QStringList>
+#include "FileLoader.hpp"
+
+// Demosaiced image as rendered by the viewer, read back from the GPU
+struct ExportImage
+{
+    std::vector<float> data; // white-balanced camera RGB, top row first
+    int width=0, height=0;
+    float cam2srgb[3][3];
+    float exposureCoef=1;
+};
+
+// Exports a list of raw files with the viewer's current settings. Loading and
+// encoding run in a thread pool, while demosaicing is done by the renderer in
+// the GUI thread, since it needs the viewer's OpenGL context. So files are
+// demosaiced one at a time, each blocking the GUI for the duration, and only
+// the decoding and encoding of other files overlap with it.
+class BatchExporter : public QObject
+{
+    Q_OBJECT
+public:
+    enum class Format
+    {
+        PNG8,   // sRGB-encoded
+        QOI,    // sRGB-encoded, 8 bits, faster to write than PNG
+        TIFF16, // sRGB-encoded
+        PFM,    // linear sRGB, floating-point
+    };
+    using Renderer = std::function<ExportImage(std::shared_ptr<LibRaw> const&)>;
+
+    BatchExporter(QStringList const& files, QString const& outputDir, Format format,
+                  Renderer renderer, QObject* parent=nullptr);
+    ~BatchExporter();
+    void start();
+    // Files already being encoded are still written
+    void cancel();
+    static QString extension(Format format);
+    // These return an error message, empty on success. The image must be in Format_RGB888.
+    static QString writePNG(QImage const& image, QString const& path);
+    static QString writeQOI(QImage const& image, QString const& path);
+
+signals:
+    void progress(int done, int total);
+    void fileFailed(QString const& filename, QString const& error);
+    void finished();
+
+private:
+    struct Loaded
+    {
+        std::shared_ptr<LibRaw> libRaw;
+        int error;
+    };
+    void startLoading();
+    void onLoaded(int index, Loaded const& loaded);
+    void onWritten(int index, QString const& error);
+    static QString write(ExportImage const& image, QString const& path, Format format);
+
+private:
+    QStringList files_;
+    QString outputDir_;
+    Format format_;
+    Renderer renderer_;
+    QThreadPool pool_;
+    std::shared_ptr<FileLoader::CancelFlag> cancelled_;
+    int nextToLoad_=0;
+    int inFlight_=0;
+    int done_=0;
+};
@@ -3,7 +3,6 @@
 #include <exiv2/exiv2.hpp>
 #include <QDebug>
 #include <QLabel>
-#include <QFileInfo>
 #include <QGridLayout>
 #include <QFontMetrics>
 
@@ -134,6 +133,7 @@ EXIFDisplay::EXIFDisplay(QWidget* parent)
     setWidget(holder);
     holder->setLayout(layout_);
     layout_->setHorizontalSpacing(QFontMetrics(font()).horizontalAdvance(' '));
+    connect(&parseWatcher_, &QFutureWatcher<FileLoader::EXIFResult>::finished, this, &EXIFDisplay::onParsed);
 }
 
 void EXIFDisplay::clear()
@@ -160,21 +160,32 @@ void EXIFDisplay::clear()
 }
 
 void EXIFDisplay::loadFile(QString const& filename)
-try
 {
     clear();
+    currentFile_ = filename;
+}
 
-    if(QFileInfo(filename).isDir())
+void EXIFDisplay::loadEXIF(QString const& filename, QFuture<FileLoader::EXIFResult> const& exif)
+{
+    parsedFile_ = filename;
+    parseWatcher_.setFuture(exif);
+}
+
+void EXIFDisplay::onParsed()
+{
+    if(parsedFile_ != currentFile_)
         return;
+    const auto result = parseWatcher_.result();
 
-    const auto image = Exiv2::ImageFactory::open(filename.toStdString());
-    if(!image.get())
+    clear();
+    if(!result.error.isEmpty())
     {
-        qDebug().nospace() << "EXIFDisplay::loadFile(): failed to open file";
+        showError(result.error);
         return;
     }
-    image->readMetadata();
-    const auto& exif = image->exifData();
+    if(!result.exif)
+        return;
+    const auto& exif = *result.exif;
 
 #if 0
     for(const auto& d : exif)
@@ -209,9 +220,9 @@ try
     }
     layout_->setRowStretch(row, 1);
 }
-catch(Exiv2::Error& e)
+
+void EXIFDisplay::showError(QString const& error)
 {
-    clear();
-    errorLabel_ = new QLabel(tr("exiv2 error: %1").arg(e.what()), 0, 0);
+    errorLabel_ = new QLabel(error, 0, 0);
     layout_->addWidget(errorLabel_, 0,0);
 }
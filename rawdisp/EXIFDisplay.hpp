@@ -1,6 +1,9 @@
 #pragma once
 
+#include <memory>
 #include <QDockWidget>
+#include <QFutureWatcher>
+#include "FileLoader.hpp"
 
 class QLabel;
 class QGridLayout;
@@ -12,11 +15,17 @@ class EXIFDisplay : public QDockWidget
 public:
     EXIFDisplay(QWidget* parent=nullptr);
     void loadFile(QString const& filename);
+    void loadEXIF(QString const& filename, QFuture<FileLoader::EXIFResult> const& exif);
 
 private:
+    void onParsed();
+    void showError(QString const& error);
     void clear();
 
 private:
     QGridLayout* layout_;
     QLabel* errorLabel_ = nullptr;
+    QString currentFile_;
+    QString parsedFile_;
+    QFutureWatcher<FileLoader::EXIFResult> parseWatcher_;
 };
@@ -0,0 +1,109 @@
+#include "FileCache.hpp"
+#include <algorithm>
+#include <QDebug>
+#include <QThread>
+#include <QSettings>
+
+FileCache::FileCache()
+    : byteBudget_(QSettings().value("FileCache/budgetMiB", 1024).toULongLong()*1024*1024)
+{
+    prefetchPool_.setMaxThreadCount(std::max(1, QThread::idealThreadCount()/2));
+}
+
+FileCache::~FileCache()
+{
+    for(const auto& loader : loaders_)
+        loader->cancel();
+}
+
+int FileCache::prefetchCount()
+{
+    return QSettings().value("FileCache/prefetchCount", 3).toInt();
+}
+
+std::shared_ptr<FileLoader> FileCache::take(QString const& filename)
+{
+    for(auto it = loaders_.begin(); it != loaders_.end(); ++it)
+    {
+        if((*it)->filename() != filename)
+            continue;
+        const auto loader = *it;
+        loaders_.erase(it);
+        if(loader->isOutdated())
+        {
+            loader->cancel();
+            return nullptr;
+        }
+        return loader;
+    }
+    return nullptr;
+}
+
+std::shared_ptr<FileLoader> FileCache::get(QString const& filename)
+{
+    auto loader = take(filename);
+    if(loader)
+        qDebug().nospace() << "Using cached data for " << filename;
+    else
+        loader = std::make_shared<FileLoader>(filename, QThreadPool::globalInstance());
+    loaders_.insert(loaders_.begin(), loader);
+    trim();
+    return loader;
+}
+
+void FileCache::prefetch(QStringList const& filenames)
+{
+    if(loaders_.empty())
+        return;
+
+    std::vector<std::shared_ptr<FileLoader>> wanted{loaders_.front()};
+    loaders_.erase(loaders_.begin());
+    for(const auto& filename : filenames)
+    {
+        if(filename == wanted.front()->filename())
+            continue;
+        auto loader = take(filename);
+        if(!loader)
+            loader = std::make_shared<FileLoader>(filename, &prefetchPool_);
+        wanted.push_back(loader);
+    }
+    const auto wantedCount = wanted.size();
+    wanted.insert(wanted.end(), loaders_.begin(), loaders_.end());
+    loaders_ = std::move(wanted);
+    cancelUnwanted(wantedCount);
+    trim();
+}
+
+void FileCache::cancelUnwanted(const std::size_t wantedCount)
+{
+    for(auto it = loaders_.begin()+wantedCount; it != loaders_.end();)
+    {
+        if((*it)->isLoading())
+        {
+            (*it)->cancel();
+            it = loaders_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void FileCache::trim()
+{
+    std::size_t totalSize = 0;
+    for(auto it = loaders_.begin(); it != loaders_.end(); ++it)
+    {
+        totalSize += (*it)->memoryUsage();
+        if(totalSize > byteBudget_ && it != loaders_.begin())
+        {
+            qDebug().nospace() << "Evicting " << loaders_.end()-it << " files from cache";
+            for(auto evicted = it; evicted != loaders_.end(); ++evicted)
+                if((*evicted)->isLoading())
+                    (*evicted)->cancel();
+            loaders_.erase(it, loaders_.end());
+            break;
+        }
+    }
+}
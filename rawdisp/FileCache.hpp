@@ -0,0 +1,35 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include "FileLoader.hpp"
+
+// Keeps recently used and prefetched files unpacked in memory, within a byte
+// budget set by the "FileCache/budgetMiB" setting.
+class FileCache
+{
+public:
+    FileCache();
+    ~FileCache();
+    std::shared_ptr<FileLoader> get(QString const& filename);
+    // Starts loading the files in the background. The order of the list
+    // is the priority: files at its end are the first to be evicted.
+    // Files still loading that are neither current nor listed are cancelled.
+    void prefetch(QStringList const& filenames);
+    static int prefetchCount();
+
+private:
+    std::shared_ptr<FileLoader> take(QString const& filename);
+    void trim();
+    void cancelUnwanted(std::size_t wantedCount);
+
+private:
+    // The file currently displayed comes first, then the prefetched ones, then the least recently used
+    std::vector<std::shared_ptr<FileLoader>> loaders_;
+    std::size_t byteBudget_;
+    // Kept separate from the global pool so that prefetching never delays loading of the current file
+    QThreadPool prefetchPool_;
+};
@@ -52,6 +52,7 @@ void FileList::listFileSiblings(QString const& filename, const bool forceReload)
 
     const auto fileNameToSelect = QFileInfo(filename).fileName();
     list_->clear();
+    lastRow_ = -1;
     dir.setNameFilters(QStringList{} << "*.arw" << "*.srf" << "*.sr2" << "*.crw" << "*.cr2" << "*.kdc"
                                      << "*.dcr" << "*.k25" << "*.raf" << "*.mef" << "*.mos" << "*.mrw"
                                      << "*.nef" << "*.orf" << "*.pef" << "*.ptx" << "*.dng" << "*.x3f"
@@ -66,12 +67,18 @@ void FileList::listFileSiblings(QString const& filename, const bool forceReload)
         {
             QSignalBlocker b(list_);
             list_->setCurrentItem(list_->item(list_->count()-1));
+            lastRow_ = list_->count()-1;
         }
     }
 }
 
 void FileList::onItemSelected()
 {
+    const int row = currentItemRow();
+    if(lastRow_ >= 0 && row >= 0 && row != lastRow_)
+        direction_ = row > lastRow_ ? 1 : -1;
+    lastRow_ = row;
+
     const auto filename = currentFileName();
     if(!filename.isEmpty())
         emit fileSelected(currentFileName());
@@ -132,3 +139,31 @@ QString FileList::currentFileName() const
     if(items.isEmpty()) return {};
     return items[0]->data(FilePathRole).toString();
 }
+
+QStringList FileList::allFiles() const
+{
+    QStringList files;
+    for(int row = 0; row < list_->count(); ++row)
+        files << list_->item(row)->data(FilePathRole).toString();
+    return files;
+}
+
+QStringList FileList::neighbourFiles(const int countAhead) const
+{
+    const int currRow = currentItemRow();
+    if(currRow < 0)
+        return {};
+
+    QStringList files;
+    for(int i = 1; i <= countAhead; ++i)
+    {
+        const int row = currRow + i*direction_;
+        if(row < 0 || row >= list_->count())
+            break;
+        files << list_->item(row)->data(FilePathRole).toString();
+    }
+    const int behindRow = currRow - direction_;
+    if(behindRow >= 0 && behindRow < list_->count())
+        files << list_->item(behindRow)->data(FilePathRole).toString();
+    return files;
+}
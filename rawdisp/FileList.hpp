@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <QString>
+#include <QStringList>
 #include <QDockWidget>
 #include <QFileSystemWatcher>
 
@@ -17,6 +18,9 @@ public:
     void selectFirstFile();
     void selectLastFile();
     QString currentFileName() const;
+    QStringList allFiles() const;
+    // Files following the current one in the direction of last navigation, then the one preceding it
+    QStringList neighbourFiles(int countAhead) const;
 signals:
     void fileSelected(QString const& filename);
 private:
@@ -26,5 +30,7 @@ private:
 private:
     QListWidget* list_ = nullptr;
     QString dir_;
+    int lastRow_ = -1;
+    int direction_ = 1;
     std::unique_ptr<QFileSystemWatcher> watcher_;
 };
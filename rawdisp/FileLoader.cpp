@@ -0,0 +1,206 @@
+#include "FileLoader.hpp"
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+#include <QBuffer>
+#include <QImageReader>
+#include <QtConcurrent>
+#include <exiv2/exiv2.hpp>
+#include "timing.hpp"
+
+namespace
+{
+
+template<typename T>
+QFutureInterface<T> makePromise()
+{
+    QFutureInterface<T> promise;
+    promise.reportStarted();
+    return promise;
+}
+
+// Runs the task in the pool, reporting its result to a future handed out before the task could be started
+template<typename T, typename Task>
+void runInto(QThreadPool*const pool, QFutureInterface<T> promise, Task task)
+{
+    QtConcurrent::run(pool, [promise,task]() mutable
+    {
+        promise.reportResult(task());
+        promise.reportFinished();
+    });
+}
+
+}
+
+FileLoader::FileLoader(QString const& filename, QThreadPool*const pool)
+    : filename_(filename)
+    , lastModified_(QFileInfo(filename).lastModified())
+    , libRaw_(new LibRaw)
+    , cancelled_(std::make_shared<CancelFlag>(false))
+{
+    const auto preview = makePromise<QImage>();
+    const auto unpackStatus = makePromise<int>();
+    const auto exif = makePromise<EXIFResult>();
+    preview_ = preview.future();
+    unpackStatus_ = unpackStatus.future();
+    exif_ = exif.future();
+    // The tasks using the file data are started when it has been read, so that no pool thread is
+    // blocked waiting for it. Preview is queued first so that it comes up before the raw image.
+    // Only these tasks hold the data, so it's freed when the last of them finishes.
+    fileSize_ = QtConcurrent::run(pool, [filename,pool,preview,unpackStatus,exif,libRaw=libRaw_,cancelled=cancelled_]
+    {
+        const auto data = readFile(filename, *cancelled);
+        runInto(pool, preview, [data,cancelled]{return loadPreview(data, *cancelled);});
+        runInto(pool, unpackStatus, [libRaw,data,cancelled]{return unpack(*libRaw, data, *cancelled);});
+        runInto(pool, exif, [data]{return parseEXIF(data);});
+        return data ? std::size_t(data->size()) : 0;
+    });
+}
+
+void FileLoader::cancel()
+{
+    qDebug().nospace() << "Cancelling loading of " << filename_;
+    *cancelled_ = true;
+    // Checked by LibRaw decoders between rows, unlike the progress callback which is only called between stages
+    libRaw_->setCancelFlag();
+}
+
+int FileLoader::progressCallback(void*const data, [[maybe_unused]] const LibRaw_progress stage,
+                                 [[maybe_unused]] const int iteration, [[maybe_unused]] const int expected)
+{
+    return *static_cast<CancelFlag*>(data);
+}
+
+std::size_t FileLoader::memoryUsage() const
+{
+    std::size_t bytes = 0;
+    if(fileSize_.isFinished() && isLoading())
+        bytes += fileSize_.result();
+    if(unpackStatus_.isFinished() && unpackStatus_.result()==LIBRAW_SUCCESS)
+    {
+        const auto& sizes = libRaw_->imgdata.sizes;
+        bytes += std::size_t(sizes.raw_pitch)*sizes.raw_height;
+    }
+    return bytes;
+}
+
+bool FileLoader::isOutdated() const
+{
+    return QFileInfo(filename_).lastModified() != lastModified_;
+}
+
+FileData FileLoader::readFile(QString const& filename, CancelFlag const& cancelled)
+{
+    if(cancelled) return {};
+
+    const auto t0 = currentTime();
+    QFile file(filename);
+    if(!file.open(QFile::ReadOnly))
+    {
+        qDebug().nospace() << "Failed to open file: " << file.errorString();
+        return {};
+    }
+    const auto size = file.size();
+    auto data = std::make_shared<QByteArray>(int(size), Qt::Uninitialized);
+    // Read in chunks to be able to stop early on slow storage
+    constexpr qint64 chunkSize = 4<<20;
+    for(qint64 pos = 0; pos < size;)
+    {
+        if(cancelled) return {};
+        const auto count = file.read(data->data()+pos, std::min(chunkSize, size-pos));
+        if(count <= 0)
+        {
+            qDebug().nospace() << "Failed to read file: " << file.errorString();
+            return {};
+        }
+        pos += count;
+    }
+    const auto t1 = currentTime();
+    qDebug().nospace() << "File read in " << double(t1-t0) << " seconds";
+    return data;
+}
+
+int FileLoader::unpack(LibRaw& libRaw, FileData const& data, CancelFlag& cancelled)
+{
+    if(cancelled)
+        return LIBRAW_CANCELLED_BY_CALLBACK;
+    if(!data)
+        return LIBRAW_IO_ERROR;
+
+    const auto t0 = currentTime();
+
+#if LIBRAW_MINOR_VERSION < 21
+    libRaw.imgdata.params.raw_processing_options &= ~LIBRAW_PROCESSING_CONVERTFLOAT_TO_INT;
+#else
+    libRaw.imgdata.rawparams.options &= ~LIBRAW_RAWOPTIONS_CONVERTFLOAT_TO_INT;
+#endif
+    libRaw.set_progress_handler(&FileLoader::progressCallback, &cancelled);
+    if(const auto error=libRaw.open_buffer(const_cast<char*>(data->constData()), data->size()))
+        return error;
+    if(const auto error=libRaw.unpack())
+        return error;
+    // The unpacked data doesn't refer to the file contents, which can then be released
+    libRaw.recycle_datastream();
+
+    const auto t1 = currentTime();
+    qDebug().nospace() << "File unpacked in " << double(t1-t0) << " seconds";
+
+    return LIBRAW_SUCCESS;
+}
+
+QImage FileLoader::loadPreview(FileData const& data, CancelFlag const& cancelled)
+{
+    if(!data || cancelled)
+        return {};
+
+    const auto t0 = currentTime();
+    LibRaw libRaw;
+    if(const auto error=libRaw.open_buffer(const_cast<char*>(data->constData()), data->size()))
+    {
+        qDebug().nospace() << "loadPreview() failed to open file: " << libraw_strerror(error);
+        return {};
+    }
+    if(const auto error = libRaw.unpack_thumb())
+    {
+        qDebug().nospace() << "loadPreview() failed to unpack thumbnail: " << libraw_strerror(error);
+        return {};
+    }
+    if(libRaw.imgdata.thumbnail.tformat != LIBRAW_THUMBNAIL_JPEG)
+    {
+        qDebug().nospace() << "Preview format is not JPEG, instead it's " << libRaw.imgdata.thumbnail.tformat;
+        return {};
+    }
+
+    auto arr = QByteArray::fromRawData(libRaw.imgdata.thumbnail.thumb, libRaw.imgdata.thumbnail.tlength);
+    QBuffer buf(&arr);
+    QImageReader reader(&buf);
+    const auto img = reader.read();
+    const auto t1 = currentTime();
+
+    if(img.isNull())
+        qDebug().nospace() << "Failed to load preview: " << reader.errorString();
+    else
+        qDebug().nospace() << "Preview loaded in " << double(t1-t0) << " seconds";
+
+    return img;
+}
+
+auto FileLoader::parseEXIF(FileData const& data) -> EXIFResult
+try
+{
+    if(!data)
+        return {nullptr, QObject::tr("failed to read file")};
+
+    const auto image = Exiv2::ImageFactory::open(reinterpret_cast<const Exiv2::byte*>(data->constData()), data->size());
+    if(!image.get())
+    {
+        qDebug().nospace() << "FileLoader::parseEXIF(): failed to open file";
+        return {nullptr, {}};
+    }
+    image->readMetadata();
+    return {std::make_shared<Exiv2::ExifData>(image->exifData()), {}};
+}
+catch(Exiv2::Error& e)
+{
+    return {nullptr, QObject::tr("exiv2 error: %1").arg(e.what())};
+}
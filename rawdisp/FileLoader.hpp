@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <libraw/libraw.h>
+#include <QImage>
+#include <QFuture>
+#include <QString>
+#include <QDateTime>
+#include <QByteArray>
+
+using FileData = std::shared_ptr<const QByteArray>;
+
+namespace Exiv2 { class ExifData; }
+
+// Reads the file only once, then shares its contents between thumbnail
+// decoding, raw data unpacking and EXIF parsing, which run concurrently.
+// The contents are released when all of them have finished.
+class QThreadPool;
+class FileLoader
+{
+public:
+    struct EXIFResult
+    {
+        std::shared_ptr<const Exiv2::ExifData> exif;
+        QString error;
+    };
+
+    FileLoader(QString const& filename, QThreadPool* pool);
+    QString const& filename() const { return filename_; }
+    std::shared_ptr<LibRaw> const& libRaw() const { return libRaw_; }
+    QFuture<QImage> const& preview() const { return preview_; }
+    QFuture<int> const& unpackStatus() const { return unpackStatus_; }
+    QFuture<EXIFResult> const& exif() const { return exif_; }
+    // Bytes held by the file data while it's in use and the unpacked raw image, as far as they are already loaded
+    std::size_t memoryUsage() const;
+    // Whether the file has changed on disk since loading was started
+    bool isOutdated() const;
+    bool isLoading() const { return !unpackStatus_.isFinished() || !preview_.isFinished() || !exif_.isFinished(); }
+    // Makes the loading tasks, including LibRaw's decoders, stop as soon as possible
+    void cancel();
+
+    // The loading steps, also for use without the viewer's cache, e.g. in batch processing
+    using CancelFlag = std::atomic<bool>;
+    static FileData readFile(QString const& filename, CancelFlag const& cancelled);
+    static int unpack(LibRaw& libRaw, FileData const& data, CancelFlag& cancelled);
+
+private:
+    static QImage loadPreview(FileData const& data, CancelFlag const& cancelled);
+    static EXIFResult parseEXIF(FileData const& data);
+    static int progressCallback(void* data, LibRaw_progress stage, int iteration, int expected);
+
+private:
+    QString filename_;
+    QDateTime lastModified_;
+    std::shared_ptr<LibRaw> libRaw_;
+    std::shared_ptr<CancelFlag> cancelled_;
+    QFuture<std::size_t> fileSize_;
+    QFuture<QImage> preview_;
+    QFuture<int> unpackStatus_;
+    QFuture<EXIFResult> exif_;
+};
@@ -0,0 +1,80 @@
+#include "HalfResImage.hpp"
+#include <cstring>
+#include <algorithm>
+#include <QDebug>
+#include "timing.hpp"
+#include "cpu-dispatch.hpp"
+#include "cfa-planes.hpp"
+
+HalfResImage HalfResImage::render(std::shared_ptr<LibRaw> const& libRaw, Params const& params,
+                                  const unsigned updateIndex, std::atomic<unsigned> const& requestIndex)
+{
+    HalfResImage out;
+    out.updateIndex = updateIndex;
+
+    // The layouts number the channels as COLOR() does, which only means RGB if cdesc says so
+    if(std::strncmp(libRaw->imgdata.idata.cdesc, "RGB", 3) != 0)
+    {
+        qDebug() << "Half-resolution image is only supported for RGB CFA";
+        return out;
+    }
+
+    const auto t0 = currentTime();
+    const auto layout = rawImageLayout(*libRaw);
+    const int w = layout.width/2, h = layout.height/2;
+    const auto black = params.blackLevel, white = params.whiteLevel;
+    const auto& wb = params.whiteBalanceCoefs;
+    std::vector<qfloat16> data(4*std::size_t(w)*h);
+
+    // The channel of each photosite of the quad is a compile-time constant, so the loop has no lookups or branches
+    const auto binQuads = [&](const auto*const raw, auto bayer)
+    {
+        using Bayer = decltype(bayer);
+        for(int y = 0; y < h; ++y)
+        {
+            if(updateIndex != requestIndex)
+                return false;
+            const auto* rowTop    = raw + (layout.top+2*y+0)*layout.stride + layout.left;
+            const auto* rowBottom = raw + (layout.top+2*y+1)*layout.stride + layout.left;
+            auto* out = &data[4*std::size_t(y)*w];
+            for(int x = 0; x < w; ++x, out += 4)
+            {
+                float quad[4];
+                quad[Bayer::c00] = rowTop[2*x];
+                quad[Bayer::c01] = rowTop[2*x+1];
+                quad[Bayer::c10] = rowBottom[2*x];
+                quad[Bayer::c11] = rowBottom[2*x+1];
+                const float max = std::max(std::max(quad[0], quad[1]), std::max(quad[2], quad[3]));
+                const float rgb[3] = {quad[0], 0.5f*(quad[1]+quad[3]), quad[2]};
+                for(int c = 0; c < 3; ++c)
+                    out[c] = qfloat16((rgb[c]-black)/(white-black)*wb[c]);
+                out[3] = qfloat16(max >= white ? 1.f : 0.f);
+            }
+        }
+        return true;
+    };
+
+    const bool haveFP = libRaw->have_fpdata();
+    bool completed = false;
+    const auto render = [&](const auto*const raw)
+    {
+        return dispatchBayerLayout(layout.channels, [&](auto bayer)
+                                   { dispatchISA([&]{ completed = binQuads(raw, bayer); }); });
+    };
+    bool isBayer = true;
+    if(haveFP && libRaw->imgdata.rawdata.float_image)
+        isBayer = render(libRaw->imgdata.rawdata.float_image);
+    else if(!haveFP && libRaw->imgdata.rawdata.raw_image)
+        isBayer = render(libRaw->imgdata.rawdata.raw_image);
+    if(!isBayer)
+        qDebug() << "Half-resolution image is only supported for Bayer CFA";
+    if(!completed)
+        return out;
+
+    out.data = std::move(data);
+    out.width = w;
+    out.height = h;
+    const auto t1 = currentTime();
+    qDebug().nospace() << "Half-resolution image rendered in " << double(t1-t0) << " seconds";
+    return out;
+}
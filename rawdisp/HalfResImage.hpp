@@ -0,0 +1,27 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <libraw/libraw.h>
+#include <QFloat16>
+
+// White-balanced camera RGB image made by binning each 2×2 CFA quad into one pixel. It's
+// much cheaper than demosaicing, so it's shown while the demosaic is pending.
+struct HalfResImage
+{
+    struct Params
+    {
+        float blackLevel;
+        float whiteLevel;
+        float whiteBalanceCoefs[3];
+    };
+
+    unsigned updateIndex=0; // Lets the receiver discard stale results
+    std::vector<qfloat16> data; // RGBA, top row first, alpha is 1 if any photosite of the quad is saturated
+    int width=0, height=0;
+
+    // Returns an empty image if the CFA is not a 2×2 RGB pattern, or if requestIndex changes from updateIndex
+    static HalfResImage render(std::shared_ptr<LibRaw> const& libRaw, Params const& params,
+                               unsigned updateIndex, std::atomic<unsigned> const& requestIndex);
+};
@@ -6,11 +6,12 @@
 #include <QMouseEvent>
 #include <QMessageBox>
 #include <QFileDialog>
-#include <QImageReader>
 #include <QtConcurrent>
+#include "srgb.hpp"
 #include "timing.hpp"
 #include "RawHistogram.hpp"
 #include "ToolsWidget.hpp"
+#include "cfa-planes.hpp"
 
 constexpr int OPENGL_MAJOR_VERSION=3;
 constexpr int OPENGL_MINOR_VERSION=3;
@@ -22,20 +23,38 @@ static QSurfaceFormat makeFormat()
     return format;
 }
 
-static double sRGBTransferFunction(const double c)
+// Keeps integer raw data in 16-bit normalized textures and the demosaiced image in half floats
+static bool useReducedPrecision()
 {
-    return c > 0.0031308 ? 1.055*std::pow(c, 1/2.4)-0.055
-                         : 12.92*c;
+    return QSettings().value("ImageCanvas/reducedPrecision", true).toBool();
 }
 
 void ImageCanvas::openFile(QString const& filename)
 {
     currentFile_ = filename;
+    ++fileIndex_;
+    ++demosaicRequestIndex_;
+    rawImageUploaded_=false;
     demosaicedImageReady_=false;
     demosaicStarted_=false;
+    halfResImageFinished_=false;
+    halfResImagePresent_=false;
+    ++halfResRequestIndex_;
+    if(tiled_)
+    {
+        // The demosaiced image texture doesn't contain the previous image
+        oldDemosaicedImagePresent_=false;
+        tiled_=false;
+    }
+    pyramid_.reset();
+    pixelProbe_.reset();
+    clearTiles();
     emit warning("");
     emit loadingFile(filename);
+    regionUpdateTimer_.stop();
+    histogram_->cancel();
     libRaw.reset();
+    loader_.reset();
 
     if(QFileInfo(filename).isDir())
     {
@@ -44,101 +63,200 @@ void ImageCanvas::openFile(QString const& filename)
     }
 
     preview_ = {};
-    previewLoadStatus_ = QtConcurrent::run([filename]{return loadPreview(filename);});
-    connect(&previewLoadWatcher_, &QFutureWatcher<int>::finished, this, &ImageCanvas::onPreviewLoaded);
-    previewLoadWatcher_.setFuture(previewLoadStatus_);
-
-    libRaw.reset(new LibRaw);
-    fileLoadStatus_ = QtConcurrent::run([libRaw=this->libRaw,filename]{return loadFile(libRaw,filename);});
-    connect(&fileLoadWatcher_, &QFutureWatcher<int>::finished, this, &ImageCanvas::onFileLoaded);
-    fileLoadWatcher_.setFuture(fileLoadStatus_);
+    loader_ = fileCache_.get(filename);
+    libRaw = loader_->libRaw();
+    emit exifLoading(filename, loader_->exif());
+    previewLoadWatcher_.setFuture(loader_->preview());
+    fileLoadWatcher_.setFuture(loader_->unpackStatus());
 }
 
-int ImageCanvas::loadFile(std::shared_ptr<LibRaw> const& libRaw, QString const& filename)
+void ImageCanvas::prefetchFiles(QStringList const& filenames)
 {
-    const auto t0 = currentTime();
-
-#if LIBRAW_MINOR_VERSION < 21
-    libRaw->imgdata.params.raw_processing_options &= ~LIBRAW_PROCESSING_CONVERTFLOAT_TO_INT;
-#else
-    libRaw->imgdata.rawparams.options &= ~LIBRAW_RAWOPTIONS_CONVERTFLOAT_TO_INT;
-#endif
-    if(const auto error=libRaw->open_file(filename.toStdString().c_str()))
-        return error;
-    if(const auto error=libRaw->unpack())
-        return error;
+    fileCache_.prefetch(filenames);
+}
 
-    const auto t1 = currentTime();
-    qDebug().nospace() << "File loaded in " << double(t1-t0) << " seconds";
+ImageCanvas::ImageCanvas(ToolsWidget* tools, RawHistogram* histogram, QWidget* parent)
+    : QOpenGLWidget(parent)
+    , tools_(tools)
+    , histogram_(histogram)
+{
+    setFormat(makeFormat());
+    setFocusPolicy(Qt::StrongFocus);
+    setMouseTracking(true);
 
-    return LIBRAW_SUCCESS;
+    connect(&previewLoadWatcher_, &QFutureWatcher<QImage>::finished, this, &ImageCanvas::onPreviewLoaded);
+    connect(&fileLoadWatcher_, &QFutureWatcher<int>::finished, this, &ImageCanvas::onFileLoaded);
+    connect(&halfResWatcher_, &QFutureWatcher<HalfResImage>::finished, this, &ImageCanvas::onHalfResImageRendered);
+    connect(&stagingWatcher_, &QFutureWatcher<void>::finished, this, &ImageCanvas::onRawDataStaged);
+    connect(&pyramidWatcher_, &QFutureWatcher<std::shared_ptr<const ImagePyramid>>::finished, this, &ImageCanvas::onPyramidBuilt);
+    connect(tools_, &ToolsWidget::settingChanged, this, &ImageCanvas::onSettingChanged);
+    connect(tools_, &ToolsWidget::demosaicSettingChanged, this, &ImageCanvas::onDemosaicSettingChanged);
+
+    regionUpdateTimer_.setSingleShot(true);
+    regionUpdateTimer_.setInterval(QSettings().value("ImageCanvas/regionUpdateIntervalMs", 100).toInt());
+    connect(&regionUpdateTimer_, &QTimer::timeout, this, [this]{ computeRegionHistogram(false); });
 }
 
-QImage ImageCanvas::loadPreview(QString const& filename)
+void ImageCanvas::onFileLoaded()
 {
-    const auto t0 = currentTime();
-    LibRaw libRaw;
-    if(const auto error=libRaw.open_file(filename.toStdString().c_str()))
+    if(!loader_) return;
+    const auto error = loader_->unpackStatus().result();
+    if(error == LIBRAW_CANCELLED_BY_CALLBACK)
+        return;
+    if(error)
     {
-        qDebug().nospace() << "loadPreview() failed to open file: " << libraw_strerror(error);
-        return {};
+        QMessageBox::critical(this, tr("Error loading file"), tr("Failed to unpack file: %1").arg(libraw_strerror(error)));
+        oldDemosaicedImagePresent_ = false;
+        halfResImageFinished_ = true;
+        emit fileLoadingFinished();
+        return;
     }
-    if(const auto error = libRaw.unpack_thumb())
+
+    updatePixelProbe();
+    const float blackLevel = getBlackLevel();
+    if(!region_.isEmpty())
+        region_ = region_.intersected(QRect(0, 0, libRaw->imgdata.sizes.width, libRaw->imgdata.sizes.height));
+    histogram_->compute(libRaw, blackLevel, region_);
+
+    HalfResImage::Params params{blackLevel, float(libRaw->imgdata.rawdata.color.maximum), {}};
+    const auto wbCoefs = whiteBalanceCoefs();
+    for(int i = 0; i < 3; ++i)
+        params.whiteBalanceCoefs[i] = wbCoefs[i];
+    const auto updateIndex = halfResRequestIndex_.load();
+    tiled_ = mustUseTiles();
+    if(tiled_)
     {
-        qDebug().nospace() << "loadPreview() failed to unpack thumbnail: " << libraw_strerror(error);
-        return {};
+        pyramidWatcher_.setFuture(QtConcurrent::run([libRaw=libRaw,params,updateIndex,&requestIndex=halfResRequestIndex_]
+        {
+            auto image = HalfResImage::render(libRaw, params, updateIndex, requestIndex);
+            if(image.data.empty())
+                return std::shared_ptr<const ImagePyramid>{};
+            return std::shared_ptr<const ImagePyramid>(std::make_shared<ImagePyramid>(std::move(image), TILE_SIZE));
+        }));
     }
-    if(libRaw.imgdata.thumbnail.tformat != LIBRAW_THUMBNAIL_JPEG)
+    else
     {
-        qDebug().nospace() << "Preview format is not JPEG, instead it's " << libRaw.imgdata.thumbnail.tformat;
-        return {};
+        halfResWatcher_.setFuture(QtConcurrent::run([libRaw=libRaw,params,updateIndex,&requestIndex=halfResRequestIndex_]
+                                                    { return HalfResImage::render(libRaw, params, updateIndex, requestIndex); }));
     }
+    update();
+}
 
-    auto arr = QByteArray::fromRawData(libRaw.imgdata.thumbnail.thumb, libRaw.imgdata.thumbnail.tlength);
-    QBuffer buf(&arr);
-    QImageReader reader(&buf);
-    const auto img = reader.read();
-    const auto t1 = currentTime();
+void ImageCanvas::onSettingChanged()
+{
+    // The settings only affect the display shader, except that the probe reports sRGB values
+    if(pixelProbe_)
+        updatePixelProbe();
+    update();
+}
 
-    if(img.isNull())
-        qDebug().nospace() << "Failed to load preview: " << reader.errorString();
+void ImageCanvas::onDemosaicSettingChanged()
+{
+    // Until the file is loaded the new settings will be picked up anyway
+    if(!libRaw || !loader_ || !loader_->unpackStatus().isFinished() || loader_->unpackStatus().result())
+        return;
+    // Denoising changes the memory needed, which may change the way of display
+    if(mustUseTiles() != tiled_)
+    {
+        openFile(currentFile_);
+        return;
+    }
+    if(tiled_)
+    {
+        // Only the full-resolution tiles are demosaiced, coarser levels come from the pyramid
+        makeCurrent();
+        for(auto it = tiles_.begin(); it != tiles_.end();)
+        {
+            if(std::get<0>(it->first) != 0)
+            {
+                ++it;
+                continue;
+            }
+            glDeleteTextures(1, &it->second.texture);
+            it = tiles_.erase(it);
+        }
+        doneCurrent();
+    }
     else
-        qDebug().nospace() << "Preview loaded in " << double(t1-t0) << " seconds";
+    {
+        // Keeps showing the current image until paintGL() redoes demosaicing, from the raw texture or from the
+        // cached denoised one. A demosaic still running on the GPU is for the old settings, so its result will be dropped.
+        demosaicedImageReady_ = false;
+        ++demosaicRequestIndex_;
+    }
+    update();
+}
 
+void ImageCanvas::updatePixelProbe()
+{
+    PixelProbe::Params params{getBlackLevel(), float(libRaw->imgdata.rawdata.color.maximum), {}, {},
+                              QSettings().value("PixelProbe/neighbourhoodSize", 5).toInt()};
+    const auto wbCoefs = whiteBalanceCoefs();
+    const auto cam2srgb = cam2srgbMatrix();
+    for(int i = 0; i < 3; ++i)
+    {
+        params.whiteBalanceCoefs[i] = wbCoefs[i];
+        for(int j = 0; j < 3; ++j)
+            params.cam2srgb[i][j] = cam2srgb(i,j);
+    }
+    pixelProbe_ = std::make_unique<PixelProbe>(libRaw, params);
+}
 
-    return img;
+bool ImageCanvas::mustUseTiles() const
+{
+    const auto& sizes = libRaw->imgdata.sizes;
+    if(sizes.raw_width > maxTextureSize_ || sizes.raw_height > maxTextureSize_)
+        return true;
+    // Raw texture, possibly denoised copy of it, and demosaiced one with mipmaps
+    const bool reducedPrecision = useReducedPrecision();
+    const double rawTexelBytes = reducedPrecision && !libRaw->have_fpdata() ? 2 : 4;
+    const double demosaicedTexelBytes = reducedPrecision ? 8+1 : 16; // RGBA16F and the clipping mask
+    const double rawBytes = rawTexelBytes * sizes.raw_width * sizes.raw_height * (tools_->mustReducePepperNoise() ? 2 : 1);
+    const double demosaicedBytes = demosaicedTexelBytes*4/3. * sizes.width * sizes.height;
+    const double maxMiB = QSettings().value("ImageCanvas/maxFullImageMiB", 1024).toDouble();
+    return (rawBytes + demosaicedBytes) / (1<<20) > maxMiB;
 }
 
-ImageCanvas::ImageCanvas(ToolsWidget* tools, RawHistogram* histogram, QWidget* parent)
-    : QOpenGLWidget(parent)
-    , tools_(tools)
-    , histogram_(histogram)
+void ImageCanvas::onPyramidBuilt()
 {
-    setFormat(makeFormat());
-    setFocusPolicy(Qt::StrongFocus);
-    setMouseTracking(true);
+    const auto pyramid = pyramidWatcher_.result();
+    if(!libRaw || !tiled_ || (pyramid && pyramid->updateIndex() != halfResRequestIndex_))
+        return;
 
-    connect(tools_, &ToolsWidget::settingChanged, this, qOverload<>(&QWidget::update));
-    connect(tools_, &ToolsWidget::demosaicSettingChanged, this, [this]{openFile(currentFile_);});
+    const auto& sizes = libRaw->imgdata.sizes;
+    qDebug().nospace() << "Image " << sizes.width << "x" << sizes.height << " will be displayed in tiles";
+    halfResImageFinished_ = true;
+    pyramid_ = pyramid;
+    emit fileLoadingFinished();
+    update();
 }
 
-void ImageCanvas::onFileLoaded()
+void ImageCanvas::onHalfResImageRendered()
 {
-    if(const auto error = fileLoadStatus_.result())
-    {
-        QMessageBox::critical(this, tr("Error loading file"), tr("Failed to unpack file: %1").arg(libraw_strerror(error)));
-        oldDemosaicedImagePresent_ = false;
-        emit fileLoadingFinished();
+    const auto image = halfResWatcher_.result();
+    if(image.updateIndex != halfResRequestIndex_)
         return;
-    }
 
-    histogram_->compute(libRaw, getBlackLevel());
+    halfResImageFinished_ = true;
+    if(!image.data.empty() && halfResImageTex_)
+    {
+        const auto t0 = currentTime();
+        makeCurrent();
+        glBindTexture(GL_TEXTURE_2D, halfResImageTex_);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, image.width, image.height, 0, GL_RGBA, GL_HALF_FLOAT, image.data.data());
+        glGenerateMipmap(GL_TEXTURE_2D);
+        doneCurrent();
+        halfResImagePresent_ = true;
+        const auto t1 = currentTime();
+        qDebug().nospace() << "Half-resolution image uploaded in " << double(t1-t0) << " seconds";
+    }
     update();
 }
 
 void ImageCanvas::onPreviewLoaded()
 {
-    preview_ = previewLoadStatus_.result();
+    if(!loader_) return;
+    preview_ = loader_->preview().result();
     if(preview_.isNull())
         emit previewNotAvailable();
     else
@@ -242,12 +360,13 @@ void main()
 #extension GL_ARB_shading_language_420pack : require
 uniform sampler2D image;
 uniform float blackLevel, whiteLevel;
-uniform float marginLeft, marginRight, marginTop, marginBottom;
+uniform float marginLeft, marginBottom;
+uniform float firstCol, lastCol, firstRow, lastRow; // where interpolation must not use photosites beyond
 uniform vec3 whiteBalanceCoefs;
-uniform mat3 cam2srgb;
 uniform bool verticalInversion;
 uniform bool reducePepperNoise;
-out vec4 linearSRGB; // w-component is 1 if any raw component is saturated
+layout(location=0) out vec4 cameraRGB; // white-balanced; w-component is 1 if any raw component is saturated
+layout(location=1) out float clippedMask; // same as cameraRGB.w, for render targets without alpha
 
 float samplePhotoSite(const vec2 pos, const vec2 offset)
 {
@@ -261,7 +380,6 @@ uniform bool RED_FIRST;
 
 void main()
 {
-    const int W = textureSize(image,0).x;
     const int H = textureSize(image,0).y;
     const vec2 pos = vec2(gl_FragCoord.x+marginLeft, H-gl_FragCoord.y-marginBottom)-0.5;
     const float vtl = samplePhotoSite(pos, vec2(-1,-1));
@@ -284,17 +402,17 @@ void main()
     if(photositeColorFilter == TOP_LEFT)
     {
         subpixelFromTopLeftCF = vcc;
-        if(pos.x==marginLeft && pos.y==marginTop)
+        if(pos.x==firstCol && pos.y==firstRow)
         {
             green = (vcr+vbc)/2;
             subpixelFromBottomRightCF = vbr;
         }
-        else if(pos.y==marginTop)
+        else if(pos.y==firstRow)
         {
             green = (vcr+vbc+vcl)/3;
             subpixelFromBottomRightCF = (vbl+vbr)/2;
         }
-        else if(pos.x==marginLeft)
+        else if(pos.x==firstCol)
         {
             green = (vtc+vcr+vbc)/3;
             subpixelFromBottomRightCF = (vtr+vbr)/2;
@@ -308,17 +426,17 @@ void main()
     else if(photositeColorFilter == TOP_RIGHT)
     {
         green = vcc;
-        if(pos.y==marginTop && pos.x==W-1-marginRight)
+        if(pos.y==firstRow && pos.x==lastCol)
         {
             subpixelFromTopLeftCF = vcl;
             subpixelFromBottomRightCF = vbc;
         }
-        else if(pos.y==marginTop)
+        else if(pos.y==firstRow)
         {
             subpixelFromTopLeftCF = (vcl+vcr)/2;
             subpixelFromBottomRightCF = vbc;
         }
-        else if(pos.x==W-1-marginRight)
+        else if(pos.x==lastCol)
         {
             subpixelFromTopLeftCF = vcl;
             subpixelFromBottomRightCF = (vtc+vbc)/2;
@@ -332,17 +450,17 @@ void main()
     else if(photositeColorFilter == BOTTOM_LEFT)
     {
         green = vcc;
-        if(pos.x==marginLeft && pos.y==H-1-marginBottom)
+        if(pos.x==firstCol && pos.y==lastRow)
         {
             subpixelFromTopLeftCF = vtc;
             subpixelFromBottomRightCF = vcr;
         }
-        else if(pos.x==marginLeft)
+        else if(pos.x==firstCol)
         {
             subpixelFromTopLeftCF = (vtc+vbc)/2;
             subpixelFromBottomRightCF = vcr;
         }
-        else if(pos.y==H-1-marginBottom)
+        else if(pos.y==lastRow)
         {
             subpixelFromTopLeftCF = vtc;
             subpixelFromBottomRightCF = (vcl+vcr)/2;
@@ -356,17 +474,17 @@ void main()
     else if(photositeColorFilter == BOTTOM_RIGHT)
     {
         subpixelFromBottomRightCF = vcc;
-        if(pos.y==H-1-marginBottom && pos.x==W-1-marginRight)
+        if(pos.y==lastRow && pos.x==lastCol)
         {
             subpixelFromTopLeftCF = vtl;
             green = (vtc+vcl)/2;
         }
-        else if(pos.y==H-1-marginBottom)
+        else if(pos.y==lastRow)
         {
             subpixelFromTopLeftCF = (vtl+vtr)/2;
             green = (vtc+vcr+vcl)/3;
         }
-        else if(pos.x==W-1-marginRight)
+        else if(pos.x==lastCol)
         {
             subpixelFromTopLeftCF = (vtl+vbl)/2;
             green = (vtc+vbc+vcl)/3;
@@ -381,7 +499,8 @@ void main()
                                     vec3(subpixelFromBottomRightCF,green,subpixelFromTopLeftCF);
     const bool highlightClipped = rawRGB.r >= whiteLevel || rawRGB.g >= whiteLevel || rawRGB.b >= whiteLevel;
     const vec3 balancedRGB = (rawRGB-blackLevel)/(whiteLevel-blackLevel)*whiteBalanceCoefs;
-    linearSRGB = vec4(cam2srgb*balancedRGB, float(highlightClipped));
+    cameraRGB = vec4(balancedRGB, float(highlightClipped));
+    clippedMask = float(highlightClipped);
 }
 )";
         if(!demosaicProgram_.addShaderFromSourceCode(QOpenGLShader::Fragment, fragSrc))
@@ -401,13 +520,18 @@ uniform vec2 shift;
 uniform vec2 viewportSize;
 uniform vec2 imageSize;
 uniform float rotationAngle;
-out vec2 texCoord;
+uniform vec2 tileOrigin; // in image pixels from the top-left corner
+uniform vec2 tileSize;
+out vec2 texCoord; // from the top-left corner of the tile
 void main()
 {
     const mat2 rot = mat2(cos(rotationAngle), sin(rotationAngle),
                          -sin(rotationAngle), cos(rotationAngle));
-    texCoord = rot*(viewportSize*vertex.xy/2 + vec2(-shift.x,shift.y))/(imageSize*scale) + 0.5;
-    gl_Position=vec4(vertex,1);
+    texCoord = vec2(vertex.x, -vertex.y)/2 + 0.5;
+    const vec2 imagePos = tileOrigin + texCoord*tileSize;
+    const vec2 imageTexCoord = vec2(imagePos.x, imageSize.y-imagePos.y)/imageSize;
+    const vec2 viewportPos = transpose(rot)*((imageTexCoord-0.5)*imageSize*scale) - vec2(-shift.x,shift.y);
+    gl_Position=vec4(2*viewportPos/viewportSize, 0, 1);
 }
 )";
         if(!displayProgram_.addShaderFromSourceCode(QOpenGLShader::Vertex, vertSrc))
@@ -417,10 +541,13 @@ void main()
 #version 330
 #extension GL_ARB_shading_language_420pack : require
 
-uniform sampler2D sRGBLinearImage;
+uniform sampler2D cameraRGBImage;
+uniform mat3 cam2srgb;
 uniform float exposureCompensationCoef;
 uniform bool showClippedHighlights;
-uniform bool demosaicedImageInverted;
+uniform bool separateClippedMask;
+uniform sampler2D clippedMask;
+uniform bool imageTopRowFirst;
 in vec2 texCoord;
 out vec4 color;
 
@@ -434,13 +561,15 @@ vec3 sRGBTransferFunction(const vec3 c)
 void main()
 {
     vec2 texcoordToUse = texCoord;
-    if(demosaicedImageInverted)
+    if(!imageTopRowFirst)
         texcoordToUse.t = 1 - texcoordToUse.t;
-    const vec4 linearSRGB = texture(sRGBLinearImage, texcoordToUse);
-    color = vec4(sRGBTransferFunction(linearSRGB.rgb*exposureCompensationCoef), 1);
+    const vec4 cameraRGB = texture(cameraRGBImage, texcoordToUse);
+    const float clipped = separateClippedMask ? texture(clippedMask, texcoordToUse).r : cameraRGB.w;
+    const vec3 linearSRGB = cam2srgb*cameraRGB.rgb;
+    color = vec4(sRGBTransferFunction(linearSRGB*exposureCompensationCoef), 1);
     if(showClippedHighlights)
     {
-        if(linearSRGB.w>0)
+        if(clipped>0)
         {
             color = mod(gl_FragCoord.x-gl_FragCoord.y-1, 6.)>2 ? vec4(0,0,0,1) : vec4(1,1,1,1);
         }
@@ -486,6 +615,10 @@ void ImageCanvas::initializeGL()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glGenBuffers(1, &uploadPBO_);
+    glGenQueries(1, &uploadTimeQuery_);
+    glGenQueries(1, &demosaicTimeQuery_);
+
     glGenFramebuffers(1, &denoiseFBO_);
     glBindFramebuffer(GL_FRAMEBUFFER, denoiseFBO_);
     glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, denoisedImageTex_, 0);
@@ -496,10 +629,33 @@ void ImageCanvas::initializeGL()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glGenTextures(1, &clippedMaskTex_);
+    glBindTexture(GL_TEXTURE_2D, clippedMaskTex_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
     glGenFramebuffers(1, &demosaicFBO_);
     glBindFramebuffer(GL_FRAMEBUFFER, demosaicFBO_);
     glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, demosaicedImageTex_, 0);
 
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize_);
+
+    glGenTextures(1, &tileRawTex_);
+    glBindTexture(GL_TEXTURE_2D, tileRawTex_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glGenFramebuffers(1, &tileFBO_);
+
+    glGenTextures(1, &halfResImageTex_);
+    glBindTexture(GL_TEXTURE_2D, halfResImageTex_);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+
     setupShaders();
 
     glFinish();
@@ -509,8 +665,24 @@ void ImageCanvas::initializeGL()
 
 ImageCanvas::~ImageCanvas()
 {
+    // The staging thread writes into the mapped pixel buffer
+    stagingWatcher_.waitForFinished();
+    // The render and pyramid threads read halfResRequestIndex_, and bumping it makes them stop early
+    ++halfResRequestIndex_;
+    halfResWatcher_.waitForFinished();
+    pyramidWatcher_.waitForFinished();
     makeCurrent();
+    if(demosaicFence_)
+        glDeleteSync(demosaicFence_);
+    glDeleteBuffers(1, &uploadPBO_);
+    glDeleteQueries(1, &uploadTimeQuery_);
+    glDeleteQueries(1, &demosaicTimeQuery_);
     glDeleteTextures(1, &rawImageTex_);
+    glDeleteTextures(1, &halfResImageTex_);
+    glDeleteTextures(1, &tileRawTex_);
+    glDeleteTextures(1, &clippedMaskTex_);
+    for(auto const& [key, tile] : tiles_)
+        glDeleteTextures(1, &tile.texture);
 }
 
 float ImageCanvas::getBlackLevel()
@@ -548,127 +720,298 @@ float ImageCanvas::getBlackLevel()
     return blackLevel;
 }
 
-void ImageCanvas::demosaicImage()
+QVector3D ImageCanvas::whiteBalanceCoefs() const
 {
-    GLint origFBO=-1;
-    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &origFBO);
+    const auto& pre_mul=libRaw->imgdata.color.pre_mul;
+    const float preMulMax=*std::max_element(std::begin(pre_mul),std::end(pre_mul));
+    return QVector3D(pre_mul[0],pre_mul[1],pre_mul[2])/preMulMax;
+}
+
+QMatrix3x3 ImageCanvas::cam2srgbMatrix() const
+{
+    if(!tools_->mustTransformToSRGB())
+        return {};
+    const auto& camrgb = libRaw->imgdata.rawdata.color.rgb_cam;
+    const float cam2srgb[9] = {camrgb[0][0], camrgb[0][1], camrgb[0][2],
+                               camrgb[1][0], camrgb[1][1], camrgb[1][2],
+                               camrgb[2][0], camrgb[2][1], camrgb[2][2]};
+    return QMatrix3x3(cam2srgb);
+}
 
+float ImageCanvas::levelDivisor() const
+{
+    return libRaw->is_floating_point() ? 1 : 65535;
+}
+
+void ImageCanvas::reducePepperNoise(const int rawWidth, const int rawHeight)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, denoiseFBO_);
+    glViewport(0, 0, rawWidth, rawHeight);
+    denoiseProgram_.bind();
+    denoiseProgram_.setUniformValue("image", 0);
+    denoiseProgram_.setUniformValue("whiteLevel", float(libRaw->imgdata.rawdata.color.maximum/levelDivisor()));
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindTexture(GL_TEXTURE_2D, denoisedImageTex_);
+}
+
+void ImageCanvas::setupDemosaicProgram()
+{
+    demosaicProgram_.bind();
+    demosaicProgram_.setUniformValue("image", 0);
     {
-        const auto t0 = currentTime();
+        demosaicedImageInverted_ = libRaw->imgdata.idata.cdesc[libRaw->COLOR(0,1)] != 'G' ||
+                                   libRaw->imgdata.idata.cdesc[libRaw->COLOR(1,0)] != 'G';
+        demosaicProgram_.setUniformValue("verticalInversion", demosaicedImageInverted_);
 
-        glActiveTexture(GL_TEXTURE0);
+        const char topLeftCF = demosaicedImageInverted_ ? libRaw->imgdata.idata.cdesc[libRaw->COLOR(1,0)]
+                                                        : libRaw->imgdata.idata.cdesc[libRaw->COLOR(0,0)];
+        if(topLeftCF == 'R')
+            demosaicProgram_.setUniformValue("RED_FIRST", true);
+        else
+            demosaicProgram_.setUniformValue("RED_FIRST", false);
+    }
+    const float blackLevel=getBlackLevel();
+    demosaicProgram_.setUniformValue("blackLevel", float(blackLevel/levelDivisor()));
+    demosaicProgram_.setUniformValue("whiteLevel", float(libRaw->imgdata.rawdata.color.maximum/levelDivisor()));
+    demosaicProgram_.setUniformValue("whiteBalanceCoefs", whiteBalanceCoefs());
+}
 
-        glBindTexture(GL_TEXTURE_2D, rawImageTex_);
-        const auto& sizes = libRaw->imgdata.rawdata.sizes;
-        const bool haveFP = libRaw->have_fpdata();
-        if(haveFP && libRaw->imgdata.rawdata.float_image)
+void ImageCanvas::setRawImageTexture(const void*const pixels)
+{
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, rawImageTex_);
+    const auto& sizes = libRaw->imgdata.rawdata.sizes;
+    const bool haveFP = libRaw->have_fpdata();
+    const bool reducedPrecision = useReducedPrecision();
+    // Rows of the raw data may be padded, and the alignment mustn't add padding of its own
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, rawImageStride(*libRaw));
+    glPixelStorei(GL_UNPACK_ALIGNMENT, haveFP ? 4 : 2);
+    glBeginQuery(GL_TIME_ELAPSED, uploadTimeQuery_);
+    if(haveFP && libRaw->imgdata.rawdata.float_image)
+    {
+        qDebug() << "Using float data";
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, sizes.raw_width, sizes.raw_height,
+                     0, GL_RED, GL_FLOAT, pixels);
+    }
+    else if(!haveFP && libRaw->imgdata.rawdata.raw_image)
+    {
+        qDebug() << "Using uint16 data";
+        glTexImage2D(GL_TEXTURE_2D, 0, reducedPrecision ? GL_R16 : GL_R32F, sizes.raw_width, sizes.raw_height,
+                     0, GL_RED, GL_UNSIGNED_SHORT, pixels);
+    }
+    else
+    {
+        qDebug() << "No image available, showing constant color";
+        constexpr float texel=0.5;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 1, 1, 0, GL_RED, GL_FLOAT, &texel);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    uploadTimePending_ = true;
+    // The raw data may have come from the pixel buffer, while the textures below get no data at all.
+    // With the buffer still bound, their null pointers would be taken as offsets into it.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // In reduced precision mode the clipping flags go to a separate 8-bit mask instead of a float alpha channel
+    glBindTexture(GL_TEXTURE_2D, clippedMaskTex_);
+    if(reducedPrecision)
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, sizes.width, sizes.height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, 1, 1, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr); // free the memory
+    // RGBA16F is required to be color-renderable, unlike RGB16F. Should the FBO still be incomplete,
+    // the image is demosaiced in full precision, with the mask kept separate.
+    glBindTexture(GL_TEXTURE_2D, demosaicedImageTex_);
+    glTexImage2D(GL_TEXTURE_2D, 0, reducedPrecision ? GL_RGBA16F : GL_RGBA32F, sizes.width, sizes.height,
+                 0, GL_RGBA, GL_FLOAT, nullptr);
+    if(reducedPrecision)
+    {
+        GLint origFBO=-1;
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &origFBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, demosaicFBO_);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, clippedMaskTex_, 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
         {
-            qDebug() << "Using float data";
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, sizes.raw_width, sizes.raw_height,
-                         0, GL_RED, GL_FLOAT, libRaw->imgdata.rawdata.float_image);
+            qWarning() << "Demosaic framebuffer with RGBA16F texture is incomplete, falling back to RGBA32F";
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, sizes.width, sizes.height, 0, GL_RGBA, GL_FLOAT, nullptr);
         }
-        else if(!haveFP && libRaw->imgdata.rawdata.raw_image)
+        glBindFramebuffer(GL_FRAMEBUFFER, origFBO);
+    }
+    demosaicedClippedMaskSeparate_ = reducedPrecision;
+    denoisedImageValid_ = false;
+    rawImageUploaded_ = true;
+}
+
+void ImageCanvas::uploadRawImage()
+{
+    // A copy in progress, even for a previous file, owns the pixel buffer until it finishes
+    if(rawDataStaging_) return;
+
+    const auto& rawdata = libRaw->imgdata.rawdata;
+    const bool haveFP = libRaw->have_fpdata();
+    const void*const src = haveFP ? static_cast<const void*>(rawdata.float_image) : rawdata.raw_image;
+    if(!src || !QSettings().value("ImageCanvas/asyncUpload", true).toBool())
+    {
+        // CPU-side staging: the driver copies from our memory, blocking the GUI thread meanwhile
+        setRawImageTexture(src);
+        return;
+    }
+
+    // The copy into a mapped pixel buffer runs in the background, then the driver can upload
+    // from the buffer asynchronously. Mapping may fail e.g. with some software renderers.
+    const std::size_t size = (haveFP ? sizeof(float) : sizeof(ushort))*std::size_t(rawImageStride(*libRaw))*rawdata.sizes.raw_height;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadPBO_);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    void*const dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if(!dst)
+    {
+        qDebug() << "Failed to map pixel buffer, uploading raw data synchronously";
+        setRawImageTexture(src);
+        return;
+    }
+    rawDataStaging_ = true;
+    stagingFileIndex_ = fileIndex_;
+    stagingWatcher_.setFuture(QtConcurrent::run([dst,src,size,libRaw=libRaw]
+    {
+        const auto t0 = currentTime();
+        std::memcpy(dst, src, size);
+        const auto t1 = currentTime();
+        qDebug().nospace() << "Raw data staged in " << double(t1-t0) << " seconds";
+    }));
+}
+
+void ImageCanvas::onRawDataStaged()
+{
+    makeCurrent();
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadPBO_);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    rawDataStaging_ = false;
+    // If another file has been opened meanwhile, the next paint will start over
+    if(stagingFileIndex_ == fileIndex_ && libRaw)
+    {
+        setRawImageTexture(nullptr); // offset in the pixel buffer
+        for(GLenum error; (error = glGetError()) != GL_NO_ERROR;)
+            qWarning().nospace() << "OpenGL error 0x" << QString::number(error, 16) << " while uploading raw data from pixel buffer";
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    doneCurrent();
+    update();
+}
+
+void ImageCanvas::onDemosaicFinished()
+{
+    if(uploadTimePending_)
+    {
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(uploadTimeQuery_, GL_QUERY_RESULT, &nanoseconds);
+        qDebug().nospace() << "Raw texture uploaded in " << nanoseconds*1e-9 << " seconds of GPU time";
+        uploadTimePending_ = false;
+    }
+    GLuint64 nanoseconds = 0;
+    glGetQueryObjectui64v(demosaicTimeQuery_, GL_QUERY_RESULT, &nanoseconds);
+    qDebug().nospace() << "Image demosaiced in " << nanoseconds*1e-9 << " seconds of GPU time";
+
+    demosaicedImageReady_ = true;
+    oldDemosaicedImagePresent_ = true;
+    emit fileLoadingFinished();
+}
+
+void ImageCanvas::demosaicImage()
+{
+    // The GPU work is only queued here. Completion is polled with a fence on the following paints,
+    // meanwhile the last valid image stays on screen and the GUI remains responsive.
+    if(demosaicFence_)
+    {
+        if(glClientWaitSync(demosaicFence_, 0, 0) == GL_TIMEOUT_EXPIRED)
         {
-            qDebug() << "Using uint16 data";
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, sizes.raw_width, sizes.raw_height,
-                         0, GL_RED, GL_UNSIGNED_SHORT, libRaw->imgdata.rawdata.raw_image);
+            QTimer::singleShot(FENCE_POLL_INTERVAL_MS, this, qOverload<>(&QWidget::update));
+            return;
         }
-        else
+        glDeleteSync(demosaicFence_);
+        demosaicFence_ = nullptr;
+        if(fenceRequestIndex_ == demosaicRequestIndex_)
         {
-            qDebug() << "No image available, showing constant color";
-            constexpr float texel=0.5;
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 1, 1, 0, GL_RED, GL_FLOAT, &texel);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            onDemosaicFinished();
+            return;
         }
+        // Otherwise the result is outdated, and we proceed to the current request
+    }
 
-        glBindTexture(GL_TEXTURE_2D, demosaicedImageTex_);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, sizes.width, sizes.height, 0, GL_RGB, GL_FLOAT, nullptr);
+    // The raw texture survives changes of the settings that only affect the later stages
+    if(!rawImageUploaded_)
+    {
+        uploadRawImage();
+        if(!rawImageUploaded_)
+            return; // onRawDataStaged() will trigger a repaint
+    }
 
-        if(tools_->mustReducePepperNoise())
-        {
-            glBindTexture(GL_TEXTURE_2D, denoisedImageTex_);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, sizes.raw_width, sizes.raw_height, 0, GL_RED, GL_FLOAT, nullptr);
-        }
+    GLint origFBO=-1;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &origFBO);
 
-        glFinish();
-        const auto t1 = currentTime();
-        qDebug().nospace() << "Textures uploaded in " << double(t1-t0) << " seconds";
+    // The denoised image is kept while the raw texture is unchanged, so that toggling denoising doesn't redo it
+    const bool mustDenoise = tools_->mustReducePepperNoise() && !denoisedImageValid_;
+    if(mustDenoise)
+    {
+        const auto& sizes = libRaw->imgdata.rawdata.sizes;
+        // Denoised values of integer data stay in [0,1], like the normalized raw texture
+        const bool normalized = useReducedPrecision() && !libRaw->have_fpdata();
+        glBindTexture(GL_TEXTURE_2D, denoisedImageTex_);
+        glTexImage2D(GL_TEXTURE_2D, 0, normalized ? GL_R16 : GL_R32F, sizes.raw_width, sizes.raw_height,
+                     0, GL_RED, GL_FLOAT, nullptr);
     }
 
-    const auto t0 = currentTime();
-
     const auto& sizes=libRaw->imgdata.sizes;
 
+    glBeginQuery(GL_TIME_ELAPSED, demosaicTimeQuery_);
     glBindVertexArray(vao_);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, rawImageTex_);
 
-    const float levelDivisor = libRaw->is_floating_point() ? 1 : 65535;
-    if(tools_->mustReducePepperNoise())
+    if(mustDenoise)
+    {
+        reducePepperNoise(sizes.raw_width, sizes.raw_height);
+        denoisedImageValid_ = true;
+    }
+    else if(tools_->mustReducePepperNoise())
     {
-        glBindFramebuffer(GL_FRAMEBUFFER, denoiseFBO_);
-        glViewport(0, 0, sizes.raw_width, sizes.raw_height);
-        denoiseProgram_.bind();
-        denoiseProgram_.setUniformValue("image", 0);
-        denoiseProgram_.setUniformValue("whiteLevel", float(libRaw->imgdata.rawdata.color.maximum/levelDivisor));
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
         glBindTexture(GL_TEXTURE_2D, denoisedImageTex_);
     }
 
     glBindFramebuffer(GL_FRAMEBUFFER, demosaicFBO_);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, demosaicedClippedMaskSeparate_ ? clippedMaskTex_ : 0, 0);
+    const GLenum drawBuffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(demosaicedClippedMaskSeparate_ ? 2 : 1, drawBuffers);
     glViewport(0, 0, sizes.width, sizes.height);
-    demosaicProgram_.bind();
-    demosaicProgram_.setUniformValue("image", 0);
-    {
-        demosaicedImageInverted_ = libRaw->imgdata.idata.cdesc[libRaw->COLOR(0,1)] != 'G' ||
-                                   libRaw->imgdata.idata.cdesc[libRaw->COLOR(1,0)] != 'G';
-        demosaicProgram_.setUniformValue("verticalInversion", demosaicedImageInverted_);
-
-        const char topLeftCF = demosaicedImageInverted_ ? libRaw->imgdata.idata.cdesc[libRaw->COLOR(1,0)]
-                                                        : libRaw->imgdata.idata.cdesc[libRaw->COLOR(0,0)];
-        if(topLeftCF == 'R')
-            demosaicProgram_.setUniformValue("RED_FIRST", true);
-        else
-            demosaicProgram_.setUniformValue("RED_FIRST", false);
-    }
-    const float blackLevel=getBlackLevel();
-    demosaicProgram_.setUniformValue("blackLevel", float(blackLevel/levelDivisor));
-    demosaicProgram_.setUniformValue("whiteLevel", float(libRaw->imgdata.rawdata.color.maximum/levelDivisor));
-    {
-        const auto& pre_mul=libRaw->imgdata.color.pre_mul;
-        const float preMulMax=*std::max_element(std::begin(pre_mul),std::end(pre_mul));
-        const auto daylightWBCoefs = QVector3D(pre_mul[0],pre_mul[1],pre_mul[2])/preMulMax;
-        demosaicProgram_.setUniformValue("whiteBalanceCoefs", daylightWBCoefs);
-    }
-    {
-        const auto& camrgb = libRaw->imgdata.rawdata.color.rgb_cam;
-        const float cam2srgb[9] = {camrgb[0][0], camrgb[0][1], camrgb[0][2],
-                                   camrgb[1][0], camrgb[1][1], camrgb[1][2],
-                                   camrgb[2][0], camrgb[2][1], camrgb[2][2]};
-        demosaicProgram_.setUniformValue("cam2srgb",
-                                         tools_->mustTransformToSRGB() ? QMatrix3x3(cam2srgb) : QMatrix3x3{});
-    }
+    setupDemosaicProgram();
+    const int marginBottom = sizes.raw_height - sizes.height - sizes.top_margin;
     demosaicProgram_.setUniformValue("marginLeft", float(sizes.left_margin));
-    demosaicProgram_.setUniformValue("marginTop", float(sizes.top_margin));
-    demosaicProgram_.setUniformValue("marginBottom", float(sizes.raw_height - sizes.height - sizes.top_margin));
-    demosaicProgram_.setUniformValue("marginRight", float(sizes.raw_width - sizes.width - sizes.left_margin));
+    demosaicProgram_.setUniformValue("marginBottom", float(marginBottom));
+    demosaicProgram_.setUniformValue("firstCol", float(sizes.left_margin));
+    demosaicProgram_.setUniformValue("firstRow", float(sizes.top_margin));
+    demosaicProgram_.setUniformValue("lastCol", float(sizes.left_margin + sizes.width - 1));
+    demosaicProgram_.setUniformValue("lastRow", float(sizes.raw_height - 1 - marginBottom));
 
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
     glBindVertexArray(0);
 
     glBindTexture(GL_TEXTURE_2D, demosaicedImageTex_);
     glGenerateMipmap(GL_TEXTURE_2D);
+    if(demosaicedClippedMaskSeparate_)
+    {
+        glBindTexture(GL_TEXTURE_2D, clippedMaskTex_);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+    glEndQuery(GL_TIME_ELAPSED);
 
-    glFinish();
-    const auto t1 = currentTime();
-    qDebug().nospace() << "Image demosaiced in " << double(t1-t0) << " seconds";
+    demosaicFence_ = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    fenceRequestIndex_ = demosaicRequestIndex_;
+    glFlush();
+    QTimer::singleShot(FENCE_POLL_INTERVAL_MS, this, qOverload<>(&QWidget::update));
 
     glBindFramebuffer(GL_FRAMEBUFFER, origFBO);
-
-    demosaicedImageReady_ = true;
-    oldDemosaicedImagePresent_ = true;
-    emit fileLoadingFinished();
 }
 
 void ImageCanvas::resizeGL([[maybe_unused]] const int w, [[maybe_unused]] const int h)
@@ -703,11 +1046,69 @@ void ImageCanvas::wheelEvent(QWheelEvent*const event)
     }
 }
 
+QRectF ImageCanvas::imageRectInWidget() const
+{
+    const QSizeF canvasSize = size();
+    const QSizeF imageSize(libRaw->imgdata.sizes.width, libRaw->imgdata.sizes.height);
+    const double scale = this->scale();
+
+    const auto centeredPos = (canvasSize - imageSize*scale)/2;
+    const QRectF centeredRect{QPointF(centeredPos.width(),centeredPos.height()), imageSize*scale};
+    return QRectF{centeredRect.topLeft()+imageShift_, centeredRect.size()};
+}
+
+QPointF ImageCanvas::widgetToImage(QPointF const& pos) const
+{
+    return (pos-imageRectInWidget().topLeft())/scale();
+}
+
+void ImageCanvas::updateRegion(QPointF const& cursorPos)
+{
+    const auto end = widgetToImage(cursorPos);
+    const QRect imageRect(0, 0, libRaw->imgdata.sizes.width, libRaw->imgdata.sizes.height);
+    const auto region = QRectF(regionStart_, end).normalized().toAlignedRect().intersected(imageRect);
+    const bool changed = region != region_;
+    region_ = region;
+    if(dragFinished)
+    {
+        // The exact histogram is only computed for the final region
+        regionUpdateTimer_.stop();
+        computeRegionHistogram(true);
+    }
+    else if(changed && !regionUpdateTimer_.isActive())
+    {
+        // Not restarted on each move, so that the histogram keeps up with a continuous drag
+        regionUpdateTimer_.start();
+    }
+    if(changed) update();
+}
+
+void ImageCanvas::computeRegionHistogram(const bool refine)
+{
+    if(!libRaw || !loader_ || !loader_->unpackStatus().isFinished()) return;
+    histogram_->compute(libRaw, getBlackLevel(), region_, refine);
+}
+
+void ImageCanvas::drawRegion()
+{
+    if(region_.isEmpty()) return;
+
+    const auto imageRect = imageRectInWidget();
+    const double scale = this->scale();
+    QPainter p(this);
+    p.setPen(QPen(Qt::yellow, 1, Qt::DashLine));
+    p.drawRect(QRectF(imageRect.topLeft()+QPointF(region_.topLeft())*scale, QSizeF(region_.size())*scale));
+}
+
 void ImageCanvas::mouseMoveEvent(QMouseEvent*const event)
 {
     if(!libRaw) return;
 
-    if(dragging_)
+    if(selectingRegion_)
+    {
+        updateRegion(event->pos(), false);
+    }
+    else if(dragging_)
     {
         imageShift_ += event->pos() - dragStartPos_;
         dragStartPos_ = event->pos();
@@ -715,17 +1116,12 @@ void ImageCanvas::mouseMoveEvent(QMouseEvent*const event)
     }
     else
     {
-        const QSizeF canvasSize = size();
-        const QSizeF imageSize(libRaw->imgdata.sizes.width, libRaw->imgdata.sizes.height);
-        const QPointF cursor = event->pos();
-        const double scale = this->scale();
-
-        const auto centeredPos = (canvasSize - imageSize*scale)/2;
-        const QRectF centeredRect{QPointF(centeredPos.width(),centeredPos.height()), imageSize*scale};
-        const QRectF imageRect{centeredRect.topLeft()+imageShift_, centeredRect.size()};
-        const auto p = (cursor-imageRect.topLeft())/scale;
-
-        emit cursorPositionUpdated(p.x(),p.y());
+        const auto p = widgetToImage(event->pos());
+        PixelProbe::Sample sample;
+        if(pixelProbe_ && pixelProbe_->sample(std::floor(p.x()), std::floor(p.y()), sample))
+            emit pixelProbed(PixelProbe::format(sample));
+        else
+            emit cursorPositionUpdated(p.x(),p.y());
     }
 }
 
@@ -733,14 +1129,25 @@ void ImageCanvas::mousePressEvent(QMouseEvent*const event)
 {
     if(!libRaw) return;
 
+    // Shift+drag selects the region for the histogram, plain drag pans the image
+    if(event->modifiers() & Qt::ShiftModifier)
+    {
+        if(!loader_ || !loader_->unpackStatus().isFinished()) return;
+        regionStart_ = widgetToImage(event->pos());
+        selectingRegion_ = true;
+        return;
+    }
     dragStartPos_ = event->pos();
     dragging_ = true;
 }
 
-void ImageCanvas::mouseReleaseEvent(QMouseEvent*)
+void ImageCanvas::mouseReleaseEvent(QMouseEvent*const event)
 {
     if(!libRaw) return;
 
+    if(selectingRegion_)
+        updateRegion(event->pos(), true);
+    selectingRegion_ = false;
     dragging_ = false;
 }
 
@@ -754,6 +1161,13 @@ void ImageCanvas::keyPressEvent(QKeyEvent*const event)
     const auto mods = event->modifiers() & (Qt::ControlModifier|Qt::ShiftModifier|Qt::AltModifier);
     switch(event->key())
     {
+    case Qt::Key_Escape:
+        if(mods || region_.isEmpty()) return;
+        region_ = {};
+        regionUpdateTimer_.stop();
+        if(libRaw && loader_ && loader_->unpackStatus().isFinished())
+            histogram_->compute(libRaw, getBlackLevel());
+        break;
     case Qt::Key_Z:
         if(mods) return;
         scaleSteps_ = 0.;
@@ -791,38 +1205,83 @@ void ImageCanvas::keyPressEvent(QKeyEvent*const event)
         emit lastFileRequested();
         break;
     case Qt::Key_S:
-        if(mods == Qt::ControlModifier && demosaicedImageReady_)
+        if(mods == (Qt::ControlModifier|Qt::ShiftModifier))
         {
-            const auto path = QFileDialog::getSaveFileName(this, "Save file as...", {}, "PNG images (*.png)");
-            if(path.isEmpty()) return;
+            emit batchExportRequested();
+            return;
+        }
+        if(mods == Qt::ControlModifier && tiled_)
+            emit warning(tr("Saving is not supported for images displayed in tiles"));
+        if(mods == Qt::ControlModifier && demosaicedImageReady_ && !tiled_)
+            saveDemosaicedImage();
+    }
+    update();
+}
 
-            makeCurrent();
-            glBindTexture(GL_TEXTURE_2D, demosaicedImageTex_);
+void ImageCanvas::saveDemosaicedImage()
+{
+    const int W = libRaw->imgdata.sizes.width;
+    const int H = libRaw->imgdata.sizes.height;
+    const std::size_t stride = 3*std::size_t(W);
+    const std::size_t bufferSize = stride*H*sizeof(qfloat16);
 
-            const int W = libRaw->imgdata.sizes.width;
-            const int H = libRaw->imgdata.sizes.height;
-            QImage img(W, H, QImage::Format_RGBA8888);
-            std::vector<GLfloat> data(4*W*H);
-            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, data.data());
+    // Readback into a pixel buffer is asynchronous, so the transfer overlaps with choosing the file name.
+    // Half floats are enough for 8-bit output and take half the bandwidth of floats.
+    makeCurrent();
+    GLuint pbo = 0;
+    glGenBuffers(1, &pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, bufferSize, nullptr, GL_STREAM_READ);
+    glPixelStorei(GL_PACK_ALIGNMENT, 2);
+    glBindTexture(GL_TEXTURE_2D, demosaicedImageTex_);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_HALF_FLOAT, nullptr);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    doneCurrent();
 
-            const auto coef = std::pow(10., tools_->exposureCompensation());
-            const auto p = img.bits();
-            const int stride = img.bytesPerLine() / sizeof p[0];
-            for(int j = 0; j < H; ++j)
-            {
-                for(int i = 0; i < W; ++i)
-                {
-                    p[(H-1-j)*stride + 4*i + 0] = 255*sRGBTransferFunction(std::clamp(data[4*(j*W+i)+0]*coef, 0., 1.));
-                    p[(H-1-j)*stride + 4*i + 1] = 255*sRGBTransferFunction(std::clamp(data[4*(j*W+i)+1]*coef, 0., 1.));
-                    p[(H-1-j)*stride + 4*i + 2] = 255*sRGBTransferFunction(std::clamp(data[4*(j*W+i)+2]*coef, 0., 1.));
-                    p[(H-1-j)*stride + 4*i + 3] = 255;
-                }
-            }
-            if(!img.save(path))
-                QMessageBox::critical(this, "Error saving image", "Failed to save the image");
+    const auto path = QFileDialog::getSaveFileName(this, tr("Save file as..."), {}, tr("PNG images (*.png);;QOI images (*.qoi)"));
+
+    makeCurrent();
+    QImage img;
+    if(!path.isEmpty())
+    {
+        const auto t0 = currentTime();
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        if(const auto data = static_cast<qfloat16 const*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bufferSize, GL_MAP_READ_BIT)))
+        {
+            const auto t1 = currentTime();
+            const float coef = std::pow(10., tools_->exposureCompensation());
+            const auto M = cam2srgbMatrix();
+            float matrix[3][3];
+            for(int i = 0; i < 3; ++i)
+                for(int j = 0; j < 3; ++j)
+                    matrix[i][j] = M(i,j)*coef;
+            img = QImage(W, H, QImage::Format_RGB888);
+            linearToSRGB8(data, 3, stride, W, H, !demosaicedImageInverted_, matrix, img.bits(), img.bytesPerLine());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            const auto t2 = currentTime();
+            qDebug().nospace() << "Image read back in " << double(t1-t0) << " seconds, converted in " << double(t2-t1) << " seconds";
         }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
     }
-    update();
+    glDeleteBuffers(1, &pbo);
+    doneCurrent();
+    if(path.isEmpty())
+        return;
+    if(img.isNull())
+    {
+        QMessageBox::critical(this, tr("Error saving image"), tr("Failed to read the image back from the GPU"));
+        return;
+    }
+
+    const auto t0 = currentTime();
+    const auto error = path.endsWith(".qoi", Qt::CaseInsensitive) ? BatchExporter::writeQOI(img, path)
+                                                                  : BatchExporter::writePNG(img, path);
+    const auto t1 = currentTime();
+    if(!error.isEmpty())
+        QMessageBox::critical(this, tr("Error saving image"), error);
+    else
+        qDebug().nospace() << "Image encoded and saved in " << double(t1-t0) << " seconds";
 }
 
 double ImageCanvas::scale() const
@@ -840,15 +1299,31 @@ double ImageCanvas::scaleToSteps(const double scale) const
     return std::log2(scale) * 2;
 }
 
-void ImageCanvas::renderLastValidImage()
+void ImageCanvas::drawImageQuad(const GLuint texture, QRectF const& area, const bool topRowFirst, const GLuint clippedMask)
+{
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, clippedMask);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    displayProgram_.setUniformValue("separateClippedMask", clippedMask != 0);
+    displayProgram_.setUniformValue("tileOrigin", QVector2D(area.x(), area.y()));
+    displayProgram_.setUniformValue("tileSize", QVector2D(area.width(), area.height()));
+    displayProgram_.setUniformValue("imageTopRowFirst", topRowFirst);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+void ImageCanvas::setupDisplayProgram()
 {
     glViewport(0, 0, width(), height());
+    // Only the image quad is drawn, so the rest of the viewport has to be cleared
+    glClearColor(0, 0, 0, 1);
+    glClear(GL_COLOR_BUFFER_BIT);
     glBindVertexArray(vao_);
 
     displayProgram_.bind();
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, demosaicedImageTex_);
-    displayProgram_.setUniformValue("sRGBLinearImage", 0);
+    displayProgram_.setUniformValue("cameraRGBImage", 0);
+    displayProgram_.setUniformValue("cam2srgb", cam2srgbMatrix());
+    displayProgram_.setUniformValue("clippedMask", 1);
     displayProgram_.setUniformValue("scale", float(scale()));
     displayProgram_.setUniformValue("shift", QVector2D(imageShift_.x(),imageShift_.y()));
     displayProgram_.setUniformValue("viewportSize", QVector2D(width(),height()));
@@ -856,18 +1331,370 @@ void ImageCanvas::renderLastValidImage()
     displayProgram_.setUniformValue("rotationAngle", float(M_PI/180*tools_->rotationAngle()));
     displayProgram_.setUniformValue("showClippedHighlights", tools_->clippedHighlightsMarkingEnabled());
     displayProgram_.setUniformValue("exposureCompensationCoef", float(std::pow(10., tools_->exposureCompensation())));
-    displayProgram_.setUniformValue("demosaicedImageInverted", demosaicedImageInverted_);
+}
+
+void ImageCanvas::renderLastValidImage()
+{
+    // Until the demosaiced image is ready, the half-resolution one is the best we've got for the current file
+    const bool useHalfRes = !demosaicedImageReady_ && halfResImagePresent_;
+
+    setupDisplayProgram();
+    // Half-resolution image has its top row first, which demosaicing does only for some CFA layouts
+    drawImageQuad(useHalfRes ? halfResImageTex_ : demosaicedImageTex_,
+                  QRectF(0, 0, libRaw->imgdata.sizes.width, libRaw->imgdata.sizes.height),
+                  useHalfRes || demosaicedImageInverted_,
+                  !useHalfRes && demosaicedClippedMaskSeparate_ ? clippedMaskTex_ : 0);
+    glBindVertexArray(0);
+}
+
+QRectF ImageCanvas::visibleImageArea() const
+{
+    // Inverse of the mapping done by the display vertex shader, applied to the viewport corners
+    const double angle = M_PI/180*tools_->rotationAngle();
+    const double cosA = std::cos(angle), sinA = std::sin(angle);
+    const double scale = this->scale();
+    const double W = libRaw->imgdata.sizes.width, H = libRaw->imgdata.sizes.height;
+    double xMin = INFINITY, xMax = -INFINITY, yMin = INFINITY, yMax = -INFINITY;
+    for(const double vx : {-1., 1.})
+    {
+        for(const double vy : {-1., 1.})
+        {
+            const double qx = width()*vx/2 - imageShift_.x();
+            const double qy = height()*vy/2 + imageShift_.y();
+            const double s = (cosA*qx - sinA*qy)/(W*scale) + 0.5;
+            const double t = (sinA*qx + cosA*qy)/(H*scale) + 0.5;
+            xMin = std::min(xMin, s*W);
+            xMax = std::max(xMax, s*W);
+            yMin = std::min(yMin, (1-t)*H);
+            yMax = std::max(yMax, (1-t)*H);
+        }
+    }
+    return QRectF(QPointF(xMin, yMin), QPointF(xMax, yMax));
+}
+
+QSize ImageCanvas::tileLevelSize(const int level) const
+{
+    if(level == 0)
+    {
+        // Full-resolution tiles have even dimensions to keep the CFA pattern the same as that of the whole image
+        return QSize(libRaw->imgdata.sizes.width/2*2, libRaw->imgdata.sizes.height/2*2);
+    }
+    const auto& pyramidLevel = pyramid_->level(level-1);
+    return QSize(pyramidLevel.width, pyramidLevel.height);
+}
+
+QRect ImageCanvas::tileRect(const int level, const int tileX, const int tileY) const
+{
+    const auto levelSize = tileLevelSize(level);
+    return QRect(tileX*TILE_SIZE, tileY*TILE_SIZE,
+                 std::min(TILE_SIZE, levelSize.width() - tileX*TILE_SIZE),
+                 std::min(TILE_SIZE, levelSize.height() - tileY*TILE_SIZE));
+}
+
+void ImageCanvas::demosaicTile(const int tileX, const int tileY, const GLuint texture, const GLenum internalFormat)
+{
+    const auto& sizes = libRaw->imgdata.sizes;
+    const auto rect = tileRect(0, tileX, tileY);
+    // The apron lets interpolation at the tile edges use the neighbouring photosites
+    constexpr int apron = 2;
+    const int rawWidth = rect.width()+2*apron, rawHeight = rect.height()+2*apron;
+    const int rawX0 = sizes.left_margin + rect.x() - apron, rawY0 = sizes.top_margin + rect.y() - apron;
+    const std::size_t stride = rawImageStride(*libRaw);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tileRawTex_);
+    const auto copyRawRect = [&](const auto*const raw, auto& buffer)
+    {
+        buffer.resize(std::size_t(rawWidth)*rawHeight);
+        for(int y = 0; y < rawHeight; ++y)
+        {
+            const int rawY = std::clamp(rawY0+y, 0, sizes.raw_height-1);
+            for(int x = 0; x < rawWidth; ++x)
+            {
+                const int rawX = std::clamp(rawX0+x, 0, sizes.raw_width-1);
+                buffer[std::size_t(y)*rawWidth+x] = raw[rawY*stride+rawX];
+            }
+        }
+    };
+    const bool haveFP = libRaw->have_fpdata();
+    if(haveFP && libRaw->imgdata.rawdata.float_image)
+    {
+        std::vector<float> buffer;
+        copyRawRect(libRaw->imgdata.rawdata.float_image, buffer);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, rawWidth, rawHeight, 0, GL_RED, GL_FLOAT, buffer.data());
+    }
+    else if(!haveFP && libRaw->imgdata.rawdata.raw_image)
+    {
+        std::vector<uint16_t> buffer;
+        copyRawRect(libRaw->imgdata.rawdata.raw_image, buffer);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, rawWidth, rawHeight, 0, GL_RED, GL_UNSIGNED_SHORT, buffer.data());
+    }
+    else
+    {
+        const std::vector<float> buffer(std::size_t(rawWidth)*rawHeight, 0.5f);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, rawWidth, rawHeight, 0, GL_RED, GL_FLOAT, buffer.data());
+    }
 
+    glBindVertexArray(vao_);
+    if(tools_->mustReducePepperNoise())
+    {
+        glBindTexture(GL_TEXTURE_2D, denoisedImageTex_);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, rawWidth, rawHeight, 0, GL_RED, GL_FLOAT, nullptr);
+        denoisedImageValid_ = false; // it's now tile-sized
+        glBindTexture(GL_TEXTURE_2D, tileRawTex_);
+        reducePepperNoise(rawWidth, rawHeight);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, rect.width(), rect.height(), 0, GL_RGBA, GL_FLOAT, nullptr);
+    glBindFramebuffer(GL_FRAMEBUFFER, tileFBO_);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0);
+    glViewport(0, 0, rect.width(), rect.height());
+    glBindTexture(GL_TEXTURE_2D, tools_->mustReducePepperNoise() ? denoisedImageTex_ : tileRawTex_);
+
+    setupDemosaicProgram();
+    demosaicProgram_.setUniformValue("marginLeft", float(apron));
+    demosaicProgram_.setUniformValue("marginBottom", float(apron));
+    // Edge handling is only for the edges of the image, not of the tile. The shader's
+    // rows go in the opposite direction when the CFA pattern requires vertical inversion.
+    constexpr float none = -1;
+    const auto levelSize = tileLevelSize(0);
+    const bool atLeft = rect.left() == 0, atRight = rect.right() == levelSize.width()-1;
+    const bool atTop = rect.top() == 0, atBottom = rect.bottom() == levelSize.height()-1;
+    const float firstRow = apron, lastRow = apron + rect.height() - 1;
+    demosaicProgram_.setUniformValue("firstCol", atLeft  ? float(apron) : none);
+    demosaicProgram_.setUniformValue("lastCol",  atRight ? float(apron + rect.width() - 1) : none);
+    demosaicProgram_.setUniformValue("firstRow", (demosaicedImageInverted_ ? atBottom : atTop) ? firstRow : none);
+    demosaicProgram_.setUniformValue("lastRow",  (demosaicedImageInverted_ ? atTop : atBottom) ? lastRow : none);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
     glBindVertexArray(0);
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+ExportImage ImageCanvas::renderForExport(std::shared_ptr<LibRaw> const& exportLibRaw)
+{
+    ExportImage image;
+    if(!isValid())
+        return image;
+
+    // Demosaicing is done in full-resolution tiles, with the functions the viewer uses for
+    // huge images. They work on the current file, so it's temporarily replaced. This has to
+    // run in the GUI thread, as the canvas's OpenGL context belongs to it, so the event loop
+    // is blocked until the whole image is read back. Moving it to a worker would need an own
+    // context shared with this one, and these functions no longer relying on libRaw.
+    const auto origLibRaw = libRaw;
+    const bool origInverted = demosaicedImageInverted_;
+    libRaw = exportLibRaw;
+
+    makeCurrent();
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    const auto size = tileLevelSize(0);
+    image.width = size.width();
+    image.height = size.height();
+    image.data.resize(3*std::size_t(image.width)*image.height);
+    std::vector<float> tileData(4*TILE_SIZE*TILE_SIZE);
+    for(int tileY = 0; tileY*TILE_SIZE < image.height; ++tileY)
+    {
+        for(int tileX = 0; tileX*TILE_SIZE < image.width; ++tileX)
+        {
+            const auto rect = tileRect(0, tileX, tileY);
+            demosaicTile(tileX, tileY, texture, GL_RGBA32F);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, tileData.data());
+            for(int y = 0; y < rect.height(); ++y)
+            {
+                const int texRow = demosaicedImageInverted_ ? y : rect.height()-1-y;
+                const float* in = &tileData[4*std::size_t(texRow)*rect.width()];
+                float* out = &image.data[3*(std::size_t(rect.y()+y)*image.width + rect.x())];
+                for(int x = 0; x < rect.width(); ++x, in += 4, out += 3)
+                    std::copy_n(in, 3, out);
+            }
+        }
+    }
+    glDeleteTextures(1, &texture);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+
+    const auto cam2srgb = cam2srgbMatrix();
+    for(int i = 0; i < 3; ++i)
+        for(int j = 0; j < 3; ++j)
+            image.cam2srgb[i][j] = cam2srgb(i,j);
+    image.exposureCoef = std::pow(10., tools_->exposureCompensation());
+
+    libRaw = origLibRaw;
+    demosaicedImageInverted_ = origInverted;
+    doneCurrent();
+    return image;
+}
+
+void ImageCanvas::uploadPyramidTile(const int level, const int tileX, const int tileY, const GLuint texture)
+{
+    const auto rect = tileRect(level, tileX, tileY);
+    const auto& pyramidLevel = pyramid_->level(level-1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, pyramidLevel.width);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, rect.x());
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, rect.y());
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, rect.width(), rect.height(), 0, GL_RGBA, GL_HALF_FLOAT,
+                 pyramidLevel.data.data());
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+ImageCanvas::Tile const* ImageCanvas::getTile(const int level, const int tileX, const int tileY, int& newTilesAllowed)
+{
+    const auto key = std::make_tuple(level, tileX, tileY);
+    const auto it = tiles_.find(key);
+    if(it != tiles_.end())
+    {
+        it->second.lastUsedFrame = frameIndex_;
+        return &it->second;
+    }
+    if(newTilesAllowed <= 0)
+        return nullptr;
+    --newTilesAllowed;
+
+    Tile tile;
+    tile.lastUsedFrame = frameIndex_;
+    glGenTextures(1, &tile.texture);
+    glBindTexture(GL_TEXTURE_2D, tile.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if(level == 0)
+    {
+        demosaicTile(tileX, tileY, tile.texture);
+        tile.topRowFirst = demosaicedImageInverted_;
+    }
+    else
+    {
+        uploadPyramidTile(level, tileX, tileY, tile.texture);
+        tile.topRowFirst = true;
+    }
+    return &(tiles_[key] = tile);
+}
+
+void ImageCanvas::evictTiles()
+{
+    const auto tileMiB = TILE_SIZE*TILE_SIZE*8*4/3. / (1<<20); // RGBA16F with mipmaps
+    const std::size_t maxTiles = QSettings().value("ImageCanvas/tileCacheMiB", 512).toDouble() / tileMiB;
+    while(tiles_.size() > maxTiles)
+    {
+        const auto oldest = std::min_element(tiles_.begin(), tiles_.end(), [](auto const& a, auto const& b)
+                                             { return a.second.lastUsedFrame < b.second.lastUsedFrame; });
+        if(oldest->second.lastUsedFrame == frameIndex_)
+            break; // everything remaining is on screen
+        glDeleteTextures(1, &oldest->second.texture);
+        tiles_.erase(oldest);
+    }
+}
+
+void ImageCanvas::clearTiles()
+{
+    if(tiles_.empty()) return;
+    makeCurrent();
+    for(auto const& [key, tile] : tiles_)
+        glDeleteTextures(1, &tile.texture);
+    doneCurrent();
+    tiles_.clear();
+}
+
+void ImageCanvas::renderTiles()
+{
+    ++frameIndex_;
+    if(!pyramid_)
+    {
+        setupDisplayProgram();
+        return;
+    }
+
+    // A tile of the coarsest level covers the whole image and stays under the finer tiles in case they are missing
+    const int coarsestLevel = pyramid_->levelCount();
+    const int level = std::clamp(int(std::floor(std::log2(1/scale()))), 0, coarsestLevel);
+    const auto visible = visibleImageArea();
+    const double tileExtent = TILE_SIZE << level; // in image pixels
+    const auto levelSize = tileLevelSize(level);
+    const int tileCountX = (levelSize.width()+TILE_SIZE-1)/TILE_SIZE;
+    const int tileCountY = (levelSize.height()+TILE_SIZE-1)/TILE_SIZE;
+    const int tileXMin = std::max(0, int(std::floor(visible.left()/tileExtent)));
+    const int tileYMin = std::max(0, int(std::floor(visible.top()/tileExtent)));
+    const int tileXMax = std::min(tileCountX-1, int(std::floor(visible.right()/tileExtent)));
+    const int tileYMax = std::min(tileCountY-1, int(std::floor(visible.bottom()/tileExtent)));
+
+    std::vector<std::tuple<int,int,int>> tileKeys{{coarsestLevel, 0, 0}};
+    if(level != coarsestLevel)
+    {
+        for(int tileY = tileYMin; tileY <= tileYMax; ++tileY)
+            for(int tileX = tileXMin; tileX <= tileXMax; ++tileX)
+                tileKeys.emplace_back(level, tileX, tileY);
+    }
+
+    // Creating tiles, especially demosaicing them, takes time, so only a few are made per frame
+    int newTilesAllowed = 16;
+    bool complete = true;
+    std::vector<std::pair<Tile, QRectF>> tilesToDraw;
+    for(auto const& [tileLevel, tileX, tileY] : tileKeys)
+    {
+        const auto tile = getTile(tileLevel, tileX, tileY, newTilesAllowed);
+        if(!tile)
+        {
+            complete = false;
+            continue;
+        }
+        const auto rect = tileRect(tileLevel, tileX, tileY);
+        const double levelScale = 1 << tileLevel;
+        tilesToDraw.emplace_back(*tile, QRectF(QPointF(rect.topLeft())*levelScale, QSizeF(rect.size())*levelScale));
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    setupDisplayProgram();
+    for(auto const& [tile, area] : tilesToDraw)
+        drawImageQuad(tile.texture, area, tile.topRowFirst);
+    glBindVertexArray(0);
+
+    evictTiles();
+    if(!complete)
+        QTimer::singleShot(0, this, qOverload<>(&QWidget::update));
+}
+
+void ImageCanvas::drawPreview()
+{
+    QPainter p(this);
+    p.setRenderHint(QPainter::SmoothPixmapTransform);
+    p.fillRect(rect(), Qt::black);
+    // Before the raw data are unpacked the image size is unknown, so the preview is then fit into the canvas
+    const bool imageSizeKnown = loader_->unpackStatus().isFinished() && libRaw->imgdata.sizes.width;
+    const QSizeF imageSize = imageSizeKnown ? QSizeF(libRaw->imgdata.sizes.width, libRaw->imgdata.sizes.height)*scale()
+                                            : QSizeF(preview_.size()).scaled(size(), Qt::KeepAspectRatio);
+    const auto centeredPos = (QSizeF(size()) - imageSize)/2;
+    const QRectF centeredRect(QPointF(centeredPos.width(),centeredPos.height()), imageSize);
+    p.drawImage(centeredRect.translated(imageShift_), preview_, preview_.rect());
 }
 
 void ImageCanvas::paintGL()
 {
     if(!isVisible()) return;
-    if(!demosaicedImageReady_)
-        demosaicImage();
-    renderLastValidImage();
+    if(tiled_)
+    {
+        renderTiles();
+    }
+    else
+    {
+        if(!demosaicedImageReady_ && demosaicStarted_)
+            demosaicImage();
+        renderLastValidImage();
+    }
+    drawRegion();
 }
 
 void ImageCanvas::paintEvent(QPaintEvent*const event)
@@ -890,9 +1717,16 @@ void ImageCanvas::paintEvent(QPaintEvent*const event)
         p.drawImage(QRect(centeredRect.topLeft()+imageShift_, centeredRect.size()), preview_, preview_.rect());
         return;
     }
-    if(!fileLoadStatus_.isFinished())
+    // The stages replace each other as they become ready: embedded preview,
+    // then half-resolution binned image, then the demosaiced one.
+    const bool unpacked = loader_->unpackStatus().isFinished();
+    if(!halfResImageFinished_)
     {
-        if(oldDemosaicedImagePresent_)
+        if(!preview_.isNull())
+        {
+            drawPreview();
+        }
+        else if(oldDemosaicedImagePresent_)
         {
             renderLastValidImage();
         }
@@ -901,14 +1735,37 @@ void ImageCanvas::paintEvent(QPaintEvent*const event)
             QPainter p(this);
             p.fillRect(rect(), Qt::black);
             p.setPen(Qt::gray);
-            p.drawText(rect(), Qt::AlignHCenter|Qt::AlignVCenter, tr("Loading file..."));
+            p.drawText(rect(), Qt::AlignHCenter|Qt::AlignVCenter, unpacked ? tr("Demosaicing image...") : tr("Loading file..."));
         }
         emit zoomChanged(scale());
         return;
     }
+    if(tiled_)
+    {
+        if(pyramid_)
+        {
+            QOpenGLWidget::paintEvent(event);
+        }
+        else
+        {
+            QPainter p(this);
+            p.fillRect(rect(), Qt::black);
+            p.setPen(Qt::gray);
+            p.drawText(rect(), Qt::AlignHCenter|Qt::AlignVCenter, tr("Image is too large to display"));
+        }
+        return;
+    }
     if(!demosaicStarted_)
     {
-        if(oldDemosaicedImagePresent_)
+        if(halfResImagePresent_)
+        {
+            QOpenGLWidget::paintEvent(event);
+        }
+        else if(!preview_.isNull())
+        {
+            drawPreview();
+        }
+        else if(oldDemosaicedImagePresent_)
         {
             renderLastValidImage();
         }
@@ -1,13 +1,22 @@
 #pragma once
 
+#include <map>
+#include <tuple>
 #include <memory>
 #include <libraw/libraw.h>
 #include <QImage>
+#include <QTimer>
 #include <QFuture>
 #include <QOpenGLWidget>
 #include <QFutureWatcher>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLFunctions_3_3_Core>
+#include "FileLoader.hpp"
+#include "FileCache.hpp"
+#include "HalfResImage.hpp"
+#include "ImagePyramid.hpp"
+#include "PixelProbe.hpp"
+#include "BatchExporter.hpp"
 
 class RawHistogram;
 class ToolsWidget;
@@ -21,20 +30,26 @@ public:
     ImageCanvas(ToolsWidget* tools, RawHistogram* histogram, QWidget* parent=nullptr);
     ~ImageCanvas();
     void openFile(QString const& filename);
+    void prefetchFiles(QStringList const& filenames);
+    // Demosaics another file with the current settings, for export
+    ExportImage renderForExport(std::shared_ptr<LibRaw> const& libRaw);
 
 signals:
     void warning(QString const&);
     void loadingFile(QString const&);
+    void exifLoading(QString const& filename, QFuture<FileLoader::EXIFResult> const& exif);
     void zoomChanged(double zoom);
     void fullScreenToggleRequested();
     void nextFileRequested();
     void prevFileRequested();
     void firstFileRequested();
     void lastFileRequested();
+    void batchExportRequested();
     void fileLoadingFinished(); // regardless whether successful or not
     void previewLoaded();
     void previewNotAvailable();
     void cursorPositionUpdated(double x, double y);
+    void pixelProbed(QString const& description); // instead of cursorPositionUpdated when raw data are available
     void cursorLeft();
 protected:
     void keyPressEvent(QKeyEvent* event) override;
@@ -48,38 +63,106 @@ protected:
     void paintGL() override;
     void paintEvent(QPaintEvent* event) override;
 private:
-    static int loadFile(std::shared_ptr<LibRaw> const& libRaw, QString const& filename);
-    static QImage loadPreview(QString const& filename);
     void setupBuffers();
     void setupShaders();
     void demosaicImage();
+    void uploadRawImage();
+    void onRawDataStaged();
+    void setRawImageTexture(const void* pixels);
+    void onDemosaicFinished();
     double scale() const;
     void onFileLoaded();
     void onPreviewLoaded();
+    void onHalfResImageRendered();
+    void onSettingChanged();
+    void onDemosaicSettingChanged();
+    void updatePixelProbe();
+    void drawPreview();
+    void drawRegion();
+    QRectF imageRectInWidget() const;
+    QPointF widgetToImage(QPointF const& pos) const;
+    void updateRegion(QPointF const& cursorPos, bool dragFinished);
+    void computeRegionHistogram(bool refine);
     void renderLastValidImage();
+    void setupDisplayProgram();
+    void setupDemosaicProgram();
+    void drawImageQuad(GLuint texture, QRectF const& area, bool topRowFirst, GLuint clippedMask=0);
+    void reducePepperNoise(int rawWidth, int rawHeight);
+    void saveDemosaicedImage();
+    float levelDivisor() const;
+    // Tiled display is for images too large to be demosaiced as a whole. Level 0 tiles are
+    // demosaiced on demand, coarser ones come from the image pyramid.
+    struct Tile
+    {
+        GLuint texture=0;
+        bool topRowFirst=false;
+        unsigned lastUsedFrame=0;
+    };
+    static constexpr int TILE_SIZE=512;
+    bool mustUseTiles() const;
+    void onPyramidBuilt();
+    void renderTiles();
+    QRectF visibleImageArea() const;
+    QSize tileLevelSize(int level) const;
+    QRect tileRect(int level, int tileX, int tileY) const;
+    Tile const* getTile(int level, int tileX, int tileY, int& newTilesAllowed);
+    void demosaicTile(int tileX, int tileY, GLuint texture, GLenum internalFormat=GL_RGBA16F);
+    void uploadPyramidTile(int level, int tileX, int tileY, GLuint texture);
+    void evictTiles();
+    void clearTiles();
     double scaleToSteps(const double scale) const;
     float getBlackLevel();
+    QVector3D whiteBalanceCoefs() const;
+    QMatrix3x3 cam2srgbMatrix() const;
 
 private:
-    GLuint rawImageTex_=0, demosaicedImageTex_=0, denoisedImageTex_=0;
+    GLuint rawImageTex_=0, demosaicedImageTex_=0, denoisedImageTex_=0, halfResImageTex_=0, clippedMaskTex_=0;
     GLuint vao_=0;
     GLuint vbo_=0;
     GLuint demosaicFBO_=0, denoiseFBO_=0;
+    GLuint tileRawTex_=0, tileFBO_=0;
+    GLuint uploadPBO_=0;
+    GLuint uploadTimeQuery_=0, demosaicTimeQuery_=0;
+    GLsync demosaicFence_=nullptr;
+    static constexpr int FENCE_POLL_INTERVAL_MS=5;
+    GLint maxTextureSize_=0;
     QOpenGLShaderProgram denoiseProgram_;
     QOpenGLShaderProgram demosaicProgram_;
     QOpenGLShaderProgram displayProgram_;
     QPoint dragStartPos_;
     QPoint imageShift_;
+    QPointF regionStart_;
+    QRect region_; // for the histogram, in image coordinates
+    bool selectingRegion_=false;
+    QTimer regionUpdateTimer_; // limits the rate of histogram updates while the region is being dragged
     std::optional<double> scaleSteps_;
-    QFuture<int> fileLoadStatus_;
+    FileCache fileCache_;
+    std::shared_ptr<FileLoader> loader_;
     QFutureWatcher<int> fileLoadWatcher_;
-    QFuture<QImage> previewLoadStatus_;
     QFutureWatcher<QImage> previewLoadWatcher_;
+    QFutureWatcher<HalfResImage> halfResWatcher_;
+    std::atomic<unsigned> halfResRequestIndex_{0};
+    QFutureWatcher<void> stagingWatcher_;
+    unsigned fileIndex_=0, stagingFileIndex_=0;
+    unsigned demosaicRequestIndex_=0, fenceRequestIndex_=0;
+    QFutureWatcher<std::shared_ptr<const ImagePyramid>> pyramidWatcher_;
+    std::shared_ptr<const ImagePyramid> pyramid_;
+    std::unique_ptr<PixelProbe> pixelProbe_;
+    std::map<std::tuple<int,int,int>, Tile> tiles_; // keyed by level and tile coordinates
+    unsigned frameIndex_=0;
     QImage preview_;
     QString currentFile_;
     bool oldDemosaicedImagePresent_=false;
+    bool rawImageUploaded_=false;
+    bool rawDataStaging_=false;
+    bool uploadTimePending_=false;
+    bool denoisedImageValid_=false; // holds the denoised whole raw image
     bool demosaicedImageInverted_=false;
+    bool demosaicedClippedMaskSeparate_=false;
     bool demosaicedImageReady_=false;
+    bool halfResImageFinished_=false;
+    bool halfResImagePresent_=false;
     bool demosaicStarted_=false;
     bool dragging_=false;
+    bool tiled_=false;
 };
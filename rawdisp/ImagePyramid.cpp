@@ -0,0 +1,48 @@
+#include "ImagePyramid.hpp"
+#include <algorithm>
+#include <QDebug>
+#include "timing.hpp"
+
+namespace
+{
+
+ImagePyramid::Level halve(ImagePyramid::Level const& src)
+{
+    ImagePyramid::Level dst;
+    dst.width = src.width/2;
+    dst.height = src.height/2;
+    dst.data.resize(4*std::size_t(dst.width)*dst.height);
+    for(int y = 0; y < dst.height; ++y)
+    {
+        const auto* rowTop    = &src.data[4*std::size_t(2*y+0)*src.width];
+        const auto* rowBottom = &src.data[4*std::size_t(2*y+1)*src.width];
+        auto* out = &dst.data[4*std::size_t(y)*dst.width];
+        for(int x = 0; x < dst.width; ++x, out += 4)
+        {
+            for(int c = 0; c < 3; ++c)
+            {
+                out[c] = qfloat16(0.25f*(float(rowTop   [8*x+c]) + float(rowTop   [8*x+4+c]) +
+                                         float(rowBottom[8*x+c]) + float(rowBottom[8*x+4+c])));
+            }
+            // Clipping flag must survive downscaling, so that it's visible when zoomed out
+            out[3] = qfloat16(std::max({float(rowTop[8*x+3]), float(rowTop[8*x+7]),
+                                        float(rowBottom[8*x+3]), float(rowBottom[8*x+7])}));
+        }
+    }
+    return dst;
+}
+
+}
+
+ImagePyramid::ImagePyramid(HalfResImage&& image, const int coarsestSize)
+    : updateIndex_(image.updateIndex)
+{
+    if(image.data.empty()) return;
+
+    const auto t0 = currentTime();
+    levels_.push_back({image.width, image.height, std::move(image.data)});
+    while(levels_.back().width > coarsestSize || levels_.back().height > coarsestSize)
+        levels_.push_back(halve(levels_.back()));
+    const auto t1 = currentTime();
+    qDebug().nospace() << "Image pyramid with " << levels_.size() << " levels built in " << double(t1-t0) << " seconds";
+}
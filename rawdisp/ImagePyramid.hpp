@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <QFloat16>
+#include "HalfResImage.hpp"
+
+// Successively halved copies of the half-resolution image. They let images
+// too large to keep whole on the GPU be displayed at any zoom, uploading only
+// the tiles of a single level that are visible.
+class ImagePyramid
+{
+public:
+    struct Level
+    {
+        int width=0, height=0;
+        std::vector<qfloat16> data; // same layout as HalfResImage::data
+    };
+
+    // Takes over the data of the image as the finest level, and stops halving when both
+    // dimensions are not larger than coarsestSize.
+    ImagePyramid(HalfResImage&& image, int coarsestSize);
+    unsigned updateIndex() const { return updateIndex_; }
+    int levelCount() const { return levels_.size(); }
+    // Level 0 has half the resolution of the raw image, each next one halves it again
+    Level const& level(int n) const { return levels_[n]; }
+
+private:
+    unsigned updateIndex_;
+    std::vector<Level> levels_;
+};
@@ -1,9 +1,14 @@
 #include "MainWindow.hpp"
+#include <array>
 #include <QScreen>
 #include <QSpinBox>
 #include <QKeyEvent>
 #include <QFileInfo>
 #include <QCheckBox>
+#include <QFileDialog>
+#include <QMessageBox>
+#include <QInputDialog>
+#include <QProgressDialog>
 #include <QStatusBar>
 #include <QHBoxLayout>
 #include <QDockWidget>
@@ -14,6 +19,7 @@
 #include "ImageCanvas.hpp"
 #include "ToolsWidget.hpp"
 #include "FileList.hpp"
+#include "BatchExporter.hpp"
 
 namespace
 {
@@ -38,6 +44,10 @@ MainWindow::MainWindow(QString const& filename)
     const auto logCheckBox = new QCheckBox(tr("logY"));
     logCheckBox->setChecked(rawHistogram->logY());
     rawHistLayout->addWidget(logCheckBox);
+    const auto rawStatsLabel = new QLabel;
+    rawStatsLabel->setToolTip(tr("Shift+drag on the image to select a region, Esc to reset"));
+    rawHistLayout->addWidget(rawStatsLabel);
+    connect(rawHistogram, &RawHistogram::statsUpdated, rawStatsLabel, &QLabel::setText);
     rawHistDock->setWidget(rawHistHolder);
     addDockWidget(Qt::RightDockWidgetArea, rawHistDock);
     docks.push_back(rawHistDock);
@@ -66,6 +76,7 @@ MainWindow::MainWindow(QString const& filename)
     connect(canvas, &ImageCanvas::loadingFile, [this]{ setCursor(Qt::WaitCursor); });
     connect(canvas, &ImageCanvas::fileLoadingFinished, [this]{ unsetCursor(); });
     connect(canvas, &ImageCanvas::loadingFile, exif, &EXIFDisplay::loadFile);
+    connect(canvas, &ImageCanvas::exifLoading, exif, &EXIFDisplay::loadEXIF);
     connect(canvas, &ImageCanvas::loadingFile, fileList, qOverload<QString const&>(&FileList::listFileSiblings));
     connect(canvas, &ImageCanvas::loadingFile, [this](QString const& file)
             { setWindowTitle(formatWindowTitle(file)); });
@@ -78,18 +89,67 @@ MainWindow::MainWindow(QString const& filename)
     connect(canvas, &ImageCanvas::previewNotAvailable, this, [tools]{ tools->disablePreview(); });
     connect(canvas, &ImageCanvas::cursorPositionUpdated, this,
             [cursorLabel](const double x, const double y){ cursorLabel->setText(QString("x,y:(%1, %2)").arg(x,0,'f',1).arg(y,0,'f',1)); });
+    connect(canvas, &ImageCanvas::pixelProbed, cursorLabel, &QLabel::setText);
     connect(canvas, &ImageCanvas::cursorLeft, this, [cursorLabel]{ cursorLabel->setText(""); });
+    connect(canvas, &ImageCanvas::batchExportRequested, this, [this,fileList]{ exportFiles(fileList->allFiles()); });
     connect(fileList, &FileList::fileSelected, canvas, &ImageCanvas::openFile);
+    connect(fileList, &FileList::fileSelected, this, [this,fileList]
+            { canvas->prefetchFiles(fileList->neighbourFiles(FileCache::prefetchCount())); });
     setCentralWidget(canvas);
     resize(qApp->primaryScreen()->size()/1.6);
 
     canvas->setFocus(Qt::OtherFocusReason);
     if(!filename.isEmpty())
+    {
         canvas->openFile(filename);
+        canvas->prefetchFiles(fileList->neighbourFiles(FileCache::prefetchCount()));
+    }
 
     qApp->installEventFilter(this);
 }
 
+void MainWindow::exportFiles(QStringList const& files)
+{
+    if(files.isEmpty())
+    {
+        statusBar()->showMessage(tr("No files to export"));
+        return;
+    }
+    const auto dir = QFileDialog::getExistingDirectory(this, tr("Export %1 files to").arg(files.size()));
+    if(dir.isEmpty()) return;
+    const QStringList formats{tr("PNG, 8 bits per channel"), tr("QOI, 8 bits per channel"),
+                              tr("TIFF, 16 bits per channel"), tr("PFM, linear 32-bit float")};
+    bool ok = false;
+    const auto formatName = QInputDialog::getItem(this, tr("Export format"), tr("Format:"), formats, 0, false, &ok);
+    if(!ok) return;
+    const auto format = std::array{BatchExporter::Format::PNG8, BatchExporter::Format::QOI,
+                                   BatchExporter::Format::TIFF16, BatchExporter::Format::PFM}[formats.indexOf(formatName)];
+
+    const auto exporter = new BatchExporter(files, dir, format,
+                                            [canvas=canvas](auto const& libRaw){ return canvas->renderForExport(libRaw); },
+                                            this);
+    const auto progress = new QProgressDialog(tr("Exporting files..."), tr("Cancel"), 0, files.size(), this);
+    progress->setWindowModality(Qt::WindowModal);
+    progress->setMinimumDuration(0);
+    const auto errors = std::make_shared<QStringList>();
+    connect(exporter, &BatchExporter::progress, progress, &QProgressDialog::setValue);
+    connect(progress, &QProgressDialog::canceled, exporter, &BatchExporter::cancel);
+    connect(exporter, &BatchExporter::fileFailed, this, [errors](QString const& file, QString const& error)
+            { *errors << QString("%1: %2").arg(QFileInfo(file).fileName()).arg(error); });
+    connect(exporter, &BatchExporter::finished, this, [this,exporter,progress,errors,total=files.size()]
+            {
+                progress->deleteLater();
+                exporter->deleteLater();
+                if(progress->wasCanceled())
+                    statusBar()->showMessage(tr("Export cancelled"));
+                else
+                    statusBar()->showMessage(tr("Exported %1 of %2 files").arg(total-errors->size()).arg(total));
+                if(!errors->isEmpty())
+                    QMessageBox::warning(this, tr("Export errors"), errors->join('\n'));
+            });
+    exporter->start();
+}
+
 void MainWindow::toggleFullScreen()
 {
     if(statusBar()->isVisible())
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <QStringList>
 #include <QMainWindow>
 
 class ImageCanvas;
@@ -9,6 +10,7 @@ public:
     MainWindow(QString const& filename);
 private:
     void toggleFullScreen();
+    void exportFiles(QStringList const& files);
     bool eventFilter(QObject* obj, QEvent* event) override;
 private:
     std::vector<QDockWidget*> docks;
@@ -0,0 +1,138 @@
+#include "PixelProbe.hpp"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <QObject>
+#include "cfa-planes.hpp"
+
+PixelProbe::PixelProbe(std::shared_ptr<LibRaw> const& libRaw, Params const& params)
+    : libRaw_(libRaw)
+    , params_(params)
+{
+    const auto layout = rawImageLayout(*libRaw_);
+    stride_ = layout.stride;
+    left_   = layout.left;
+    top_    = layout.top;
+    width_  = layout.width;
+    height_ = layout.height;
+    std::copy_n(&layout.channels[0][0], 4, &channels_[0][0]);
+    const auto& cdesc = libRaw_->imgdata.idata.cdesc;
+    isBayer_ = std::strncmp(cdesc, "RGB", 3) == 0 && dispatchBayerLayout(channels_, [](auto){});
+    for(int row = 0; row < PATTERN_ROWS; ++row)
+    {
+        for(int col = 0; col < PATTERN_COLS; ++col)
+        {
+            const int color = libRaw_->COLOR(row, col);
+            const char cf = color>=0 && color<4 ? cdesc[color] : '?';
+            pattern_[row][col] = cf=='R' ? 0 : cf=='G' ? 1 : cf=='B' ? 2 : -1;
+        }
+    }
+}
+
+bool PixelProbe::sample(const int x, const int y, Sample& out) const
+{
+    if(x < 0 || y < 0 || x >= width_ || y >= height_ || width_ < 2 || height_ < 2)
+        return false;
+    out.x = x;
+    out.y = y;
+    out.quadX = std::min(x & ~1, width_-2);
+    out.quadY = std::min(y & ~1, height_-2);
+    out.neighbourhoodSize = params_.neighbourhoodSize;
+
+    const auto& rawdata = libRaw_->imgdata.rawdata;
+    const bool haveFP = libRaw_->have_fpdata();
+    if(haveFP && rawdata.float_image)
+        fillSample(rawdata.float_image, out);
+    else if(!haveFP && rawdata.raw_image)
+        fillSample(rawdata.raw_image, out);
+    else
+        return false;
+    return true;
+}
+
+template<typename Pixel>
+void PixelProbe::fillSample(Pixel const*const data, Sample& out) const
+{
+    const bool dispatched = isBayer_ && dispatchBayerLayout(channels_, [&](auto layout)
+    {
+        using Layout = decltype(layout);
+        // Both greens count as green
+        fillSample(data, [](const int x, const int y) { const int c = Layout::channel(y, x); return c==3 ? 1 : c; }, out);
+    });
+    if(!dispatched)
+        fillSample(data, [this](const int x, const int y) { return int(pattern_[y%PATTERN_ROWS][x%PATTERN_COLS]); }, out);
+}
+
+template<typename Pixel, typename ChannelAt>
+void PixelProbe::fillSample(Pixel const*const data, ChannelAt channelAt, Sample& out) const
+{
+    const auto at = [&](const int x, const int y) { return float(data[std::size_t(top_+y)*stride_ + left_+x]); };
+    const float black = params_.blackLevel, white = params_.whiteLevel;
+
+    float sums[3] = {};
+    int counts[3] = {};
+    float max = -INFINITY;
+    for(int j = 0; j < 2; ++j)
+    {
+        for(int i = 0; i < 2; ++i)
+        {
+            const int x = out.quadX+i, y = out.quadY+j;
+            const float v = at(x, y);
+            out.quad[j][i] = v;
+            out.quadMinusBlack[j][i] = v - black;
+            max = std::max(max, v);
+            const int c = channelAt(x, y);
+            out.quadColors[j][i] = c >= 0 ? "RGB"[c] : '?';
+            if(c >= 0)
+            {
+                sums[c] += v;
+                ++counts[c];
+            }
+        }
+    }
+    out.clipped = max >= white;
+    float rgb[3];
+    for(int c = 0; c < 3; ++c)
+        rgb[c] = counts[c] ? (sums[c]/counts[c]-black)/(white-black)*params_.whiteBalanceCoefs[c] : NAN;
+    const auto& M = params_.cam2srgb;
+    for(int c = 0; c < 3; ++c)
+        out.linearSRGB[c] = M[c][0]*rgb[0] + M[c][1]*rgb[1] + M[c][2]*rgb[2];
+
+    // Clipped to the visible area, so near the edges fewer photosites are averaged
+    const int half = params_.neighbourhoodSize/2;
+    const int xBegin = std::max(0, out.x-half), xEnd = std::min(width_,  out.x-half+params_.neighbourhoodSize);
+    const int yBegin = std::max(0, out.y-half), yEnd = std::min(height_, out.y-half+params_.neighbourhoodSize);
+    double meanSums[3] = {};
+    int meanCounts[3] = {};
+    for(int y = yBegin; y < yEnd; ++y)
+    {
+        for(int x = xBegin; x < xEnd; ++x)
+        {
+            const int c = channelAt(x, y);
+            if(c < 0) continue;
+            meanSums[c] += at(x, y) - black;
+            ++meanCounts[c];
+        }
+    }
+    for(int c = 0; c < 3; ++c)
+        out.meanRGB[c] = meanCounts[c] ? meanSums[c]/meanCounts[c] : NAN;
+}
+
+QString PixelProbe::format(Sample const& s)
+{
+    const auto value = [](const float v) { return QString::number(v, 'g', 6); };
+    QString quad;
+    for(int j = 0; j < 2; ++j)
+    {
+        for(int i = 0; i < 2; ++i)
+        {
+            if(!quad.isEmpty()) quad += ' ';
+            quad += QString("%1:%2").arg(QChar(s.quadColors[j][i])).arg(value(s.quadMinusBlack[j][i]));
+        }
+    }
+    return QObject::tr("x,y:(%1, %2)  quad-black:[%3]%4  sRGB:(%5, %6, %7)  %8\u00d7%8 mean-black:(%9, %10, %11)")
+                .arg(s.x).arg(s.y).arg(quad).arg(s.clipped ? QObject::tr(" clipped") : QString{})
+                .arg(s.linearSRGB[0],0,'f',4).arg(s.linearSRGB[1],0,'f',4).arg(s.linearSRGB[2],0,'f',4)
+                .arg(s.neighbourhoodSize)
+                .arg(value(s.meanRGB[0])).arg(value(s.meanRGB[1])).arg(value(s.meanRGB[2]));
+}
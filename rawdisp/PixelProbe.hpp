@@ -0,0 +1,55 @@
+#pragma once
+
+#include <memory>
+#include <libraw/libraw.h>
+#include <QString>
+
+// Looks up raw values around a point of the visible area. It's only created
+// once the file is unpacked, and the raw data don't change after that, so
+// lookups don't need to synchronize with the loading threads.
+class PixelProbe
+{
+public:
+    struct Params
+    {
+        float blackLevel;
+        float whiteLevel;
+        float whiteBalanceCoefs[3];
+        float cam2srgb[3][3];
+        int neighbourhoodSize; // side of the square whose per-channel means are computed
+    };
+    struct Sample
+    {
+        int x, y;           // photosite under the cursor
+        int quadX, quadY;   // top-left photosite of the 2×2 quad containing it
+        char quadColors[2][2];
+        float quad[2][2];   // raw values
+        float quadMinusBlack[2][2];
+        bool clipped;       // any photosite of the quad reached white level
+        float linearSRGB[3];  // of the quad, white-balanced and normalized to white level
+        float meanRGB[3];     // black-subtracted camera RGB means over the neighbourhood
+        int neighbourhoodSize;
+    };
+
+    PixelProbe(std::shared_ptr<LibRaw> const& libRaw, Params const& params);
+    // Returns false if the point is outside of the visible area
+    bool sample(int x, int y, Sample& out) const;
+    static QString format(Sample const& sample);
+
+private:
+    // channelAt(x,y) gives the RGB index of the photosite of the visible area, or -1 for other colors
+    template<typename Pixel, typename ChannelAt>
+    void fillSample(Pixel const* data, ChannelAt channelAt, Sample& out) const;
+    template<typename Pixel> void fillSample(Pixel const* data, Sample& out) const;
+
+private:
+    std::shared_ptr<LibRaw> libRaw_; // keeps the data alive
+    Params params_;
+    int stride_, left_, top_, width_, height_;
+    // Bayer CFAs are sampled with the layout as compile-time constants, like in the CLI tools
+    int channels_[2][2]; // of the top-left quad of the visible area, numbered as by COLOR()
+    bool isBayer_;
+    // Other CFAs are looked up in the pattern. COLOR() repeats with a period of at most 6×6 for X-Trans.
+    static constexpr int PATTERN_ROWS=24, PATTERN_COLS=6;
+    signed char pattern_[PATTERN_ROWS][PATTERN_COLS]; // 0=R, 1=G, 2=B, -1 for other colors
+};
@@ -1,139 +1,174 @@
 #include "RawHistogram.hpp"
+#include <algorithm>
+#include <cmath>
 #include <QDebug>
 #include <QPainter>
 #include <QResizeEvent>
 #include <QtConcurrent>
 #include "timing.hpp"
+#include "cfa-planes.hpp"
+
+namespace
+{
+
+unsigned binNum(const float value, const float binScale, const int numBins)
+{
+    return std::min(std::max(0.f, value*binScale + 0.5f), float(numBins-1));
+}
+
+struct HistogramBand
+{
+    int yBegin, yEnd; // relative to the visible area, aligned to CFA quads
+    CFAHistogram hist;
+};
+
+}
 
 RawHistogram::RawHistogram(QWidget* parent)
     : QWidget(parent)
 {
     setAttribute(Qt::WA_NoSystemBackground);
-    connect(&updateWatcher_, &QFutureWatcher<Update>::finished, this, &RawHistogram::onComputed);
+    connect(&updateWatcher_, &QFutureWatcher<std::shared_ptr<const CFAHistogram>>::finished, this, &RawHistogram::onComputed);
     logarithmic_ = QSettings().value("RawHistogram/logY", false).toBool();
+    sampleStep_ = std::max(1, QSettings().value("RawHistogram/sampleStep", 8).toInt());
 }
 
-void RawHistogram::compute(std::shared_ptr<LibRaw> const& libRaw, const float blackLevel)
+void RawHistogram::compute(std::shared_ptr<LibRaw> const& libRaw, const float blackLevel, QRect const& region,
+                           const bool refine)
 {
-    libRaw_=libRaw;
     blackLevel_=blackLevel;
-    compute();
+    whiteLevel_=libRaw->imgdata.rawdata.color.maximum;
+    region_=region;
+    if(source_ != libRaw.get())
+    {
+        // When only the region changes, e.g. while it's being dragged, old data are kept until the new ones arrive
+        source_ = libRaw.get();
+        fineHist_.reset();
+        rebin();
+        emit statsUpdated({});
+        update();
+    }
+    ++lastUpdateIndex_;
+    // A sample of the rows gives a quick estimate, which is then refined in onComputed()
+    refineSource_ = sampleStep_>1 && refine ? libRaw : nullptr;
+    start(libRaw, blackLevel, region, QuadRowSample{sampleStep_});
 }
 
-void RawHistogram::compute()
+// Uses the current update index, so that cancel() and newer requests stop the computation
+void RawHistogram::start(std::shared_ptr<LibRaw> const& libRaw, const float blackLevel, QRect const& region,
+                         const QuadRowSample sample)
 {
-    if(libRaw_.use_count() == 1)
+    const auto future = QtConcurrent::run([libRaw,blackLevel,region,sample,updateIndex=lastUpdateIndex_.load(),
+                                           &lastUpdateIndex=lastUpdateIndex_]() -> std::shared_ptr<const CFAHistogram>
     {
-        // We are the last owner of this instance of LibRaw, so it's no longer relevant
-        libRaw_.reset();
-        red_.clear();
-        green_.clear();
-        blue_.clear();
-        qDebug() << "Cleared histogram data";
-    }
-    if(!libRaw_) return;
+        const auto t0 = currentTime();
+        const auto& sizes = libRaw->imgdata.sizes;
+        const bool haveFP = libRaw->have_fpdata();
+        const auto*const floatData = libRaw->imgdata.rawdata.float_image;
+        const auto*const intData = libRaw->imgdata.rawdata.raw_image;
+        if(haveFP ? !floatData : !intData)
+            return nullptr;
 
-    red_.clear();
-    green_.clear();
-    blue_.clear();
-    update();
-    ++lastUpdateIndex_;
-    const auto future = QtConcurrent::run([libRaw=libRaw_,blackLevel=blackLevel_,histWidth=width(),
-                                           updateIndex=lastUpdateIndex_.load(),
-                                           &lastUpdateIndex=lastUpdateIndex_]
-    {
-        const auto numBins = histWidth - 2; // two columns reserved for black & white levels
-        auto out=std::make_shared<Update>();
-        out->red.resize(numBins);
-        out->green.resize(numBins);
-        out->blue.resize(numBins);
+        // The region is aligned to CFA quads, so that the channel layout is the same as for the whole image
+        const QRect imageRect(0, 0, sizes.width, sizes.height);
+        const auto area = region.isEmpty() ? imageRect : region.intersected(imageRect);
+        const int left = area.left()/2*2, top = area.top()/2*2;
+        CFAHistogram::Layout layout;
+        layout.stride = rawImageStride(*libRaw);
+        layout.left = sizes.left_margin + left;
+        layout.top = sizes.top_margin + top;
+        layout.width = area.right()+1 - left;
+        layout.height = area.bottom()+1 - top;
+        for(int row=0; row<2; ++row)
+            for(int col=0; col<2; ++col)
+                layout.channels[row][col] = libRaw->COLOR(row,col);
 
-        const auto quit = [&out] { out->red.clear(); out->green.clear(); out->blue.clear(); return out; };
+        // Integer data get a bin per code value, up to where the display range ends
+        const float whiteLevel = libRaw->imgdata.rawdata.color.maximum;
+        const float rangeMax = 1.1f*whiteLevel;
+        CFAHistogram::Params params;
+        params.numBins = haveFP ? 16384 : std::min(1<<16, int(std::ceil(rangeMax))+1);
+        params.binsPerUnit = haveFP ? params.numBins/rangeMax : 1;
+        params.blackLevel = blackLevel;
+        params.whiteLevel = whiteLevel;
+        params.sample = sample.limitedTo(layout.height/2);
 
-        const bool haveFP = libRaw->have_fpdata();
-        const auto marginLeft = libRaw->imgdata.sizes.left_margin;
-        const auto marginTop  = libRaw->imgdata.sizes.top_margin;
-        const auto xMax = marginLeft + libRaw->imgdata.sizes.width;
-        const auto yMax = marginTop  + libRaw->imgdata.sizes.height;
-        const auto stride = libRaw->imgdata.sizes.raw_width;
-        const auto col00 = libRaw->imgdata.idata.cdesc[libRaw->COLOR(0,0)];
-        const auto col01 = libRaw->imgdata.idata.cdesc[libRaw->COLOR(0,1)];
-        const auto col10 = libRaw->imgdata.idata.cdesc[libRaw->COLOR(1,0)];
-        const auto col11 = libRaw->imgdata.idata.cdesc[libRaw->COLOR(1,1)];
-        auto& topLeft     = col00=='R' ? out->red : col00=='G' ? out->green : out->blue;
-        auto& topRight    = col01=='R' ? out->red : col01=='G' ? out->green : out->blue;
-        auto& bottomLeft  = col10=='R' ? out->red : col10=='G' ? out->green : out->blue;
-        auto& bottomRight = col11=='R' ? out->red : col11=='G' ? out->green : out->blue;
-        const auto whiteLevel = libRaw->imgdata.rawdata.color.maximum;
-        const auto t0 = currentTime();
-        if(haveFP && libRaw->imgdata.rawdata.float_image)
+        // Each band gets its own histogram, so that the bands can be binned concurrently without
+        // contention. Having a few bands per thread balances the load and makes cancellation quicker.
+        const int quadRows = layout.height/2;
+        const int bandCount = std::max(1, std::min(quadRows, 2*QThreadPool::globalInstance()->maxThreadCount()));
+        std::vector<HistogramBand> bands(bandCount, HistogramBand{0,0,CFAHistogram(params)});
+        for(int n=0; n<bandCount; ++n)
         {
-            const auto* data = libRaw->imgdata.rawdata.float_image;
-            const auto binNum = [=](const float v) -> unsigned
-                                {
-                                    const auto b = std::lround(double(v)/(1.1*whiteLevel)*(numBins-1));
-                                    return b>=numBins ? numBins-1 : b;
-                                };
-            out->blackLevelBin=binNum(blackLevel);
-            out->whiteLevelBin=binNum(whiteLevel);
-            for(int y=marginTop; y<yMax-1; y+=2)
-            {
-                for(int x=marginLeft; x<xMax-1; x+=2)
-                {
-                    if(updateIndex!=lastUpdateIndex)
-                        return quit();
-                    const auto tl = data[(y+0)*stride+x+0];
-                    const auto tr = data[(y+0)*stride+x+1];
-                    const auto bl = data[(y+1)*stride+x+0];
-                    const auto br = data[(y+1)*stride+x+1];
-                    ++topLeft[binNum(tl)];
-                    ++topRight[binNum(tr)];
-                    ++bottomLeft[binNum(bl)];
-                    ++bottomRight[binNum(br)];
-                }
-            }
+            bands[n].yBegin = 2*(quadRows* n   /bandCount);
+            bands[n].yEnd   = 2*(quadRows*(n+1)/bandCount);
         }
-        else if(!haveFP && libRaw->imgdata.rawdata.raw_image)
+        QtConcurrent::blockingMap(bands, [&](HistogramBand& band)
         {
-            const auto* data = libRaw->imgdata.rawdata.raw_image;
-            const auto binNum = [=](const unsigned v) -> unsigned
-                                {
-                                    const auto b = std::lround(double(v)/(1.1*whiteLevel)*(numBins-1));
-                                    return b>=numBins ? numBins-1 : b;
-                                };
-            out->blackLevelBin=binNum(blackLevel);
-            out->whiteLevelBin=binNum(whiteLevel);
-            for(int y=marginTop; y<yMax-1; y+=2)
-            {
-                for(int x=marginLeft; x<xMax-1; x+=2)
-                {
-                    if(updateIndex!=lastUpdateIndex)
-                        return quit();
-                    const auto tl = data[(y+0)*stride+x+0];
-                    const auto tr = data[(y+0)*stride+x+1];
-                    const auto bl = data[(y+1)*stride+x+0];
-                    const auto br = data[(y+1)*stride+x+1];
-                    ++topLeft[binNum(tl)];
-                    ++topRight[binNum(tr)];
-                    ++bottomLeft[binNum(bl)];
-                    ++bottomRight[binNum(br)];
-                }
-            }
-        }
-        if(out->red.size())
-        {
-            const auto redMax   = *std::max_element(out->red.begin(), out->red.end());
-            const auto greenMax = *std::max_element(out->green.begin(), out->green.end());
-            const auto blueMax  = *std::max_element(out->blue.begin(), out->blue.end());
-            out->countMax = std::max({redMax,(greenMax+1)/2,blueMax});
-            const auto t1 = currentTime();
-            qDebug().nospace() << "Raw histogram with " << numBins << " bins computed in " << double(t1-t0) << " seconds";
-        }
-        return out;
+            if(updateIndex!=lastUpdateIndex)
+                return;
+            if(haveFP)
+                band.hist.accumulate(floatData, layout, band.yBegin, band.yEnd);
+            else
+                band.hist.accumulate(intData, layout, band.yBegin, band.yEnd);
+        });
+        if(updateIndex!=lastUpdateIndex)
+            return nullptr;
+
+        auto hist = std::make_shared<CFAHistogram>(std::move(bands[0].hist));
+        for(unsigned n=1; n<bands.size(); ++n)
+            hist->merge(bands[n].hist);
+
+        const auto t1 = currentTime();
+        qDebug().nospace() << (hist->sampled() ? "Sampled raw histogram" : "Raw histogram") << " with "
+                           << params.numBins << " bins computed in " << double(t1-t0)
+                           << " seconds using " << bandCount << " bands";
+        return hist;
     });
     updateWatcher_.setFuture(future);
 }
 
+void RawHistogram::cancel()
+{
+    ++lastUpdateIndex_;
+    refineSource_.reset();
+}
+
+void RawHistogram::rebin()
+{
+    red_.clear();
+    green_.clear();
+    blue_.clear();
+    const int numBins = width() - 2; // two columns reserved for black & white levels
+    if(!fineHist_ || numBins <= 0)
+        return;
+
+    red_.resize(numBins);
+    green_.resize(numBins);
+    blue_.resize(numBins);
+    // Display bins span [0, 1.1*whiteLevel], and a fine bin goes to the one nearest to the fine bin's lower edge
+    const float binScale = (numBins-1)/(1.1f*whiteLevel_);
+    const auto& fineParams = fineHist_->params();
+    const auto*const red    = fineHist_->counts(CFAHistogram::Red);
+    const auto*const green1 = fineHist_->counts(CFAHistogram::Green1);
+    const auto*const green2 = fineHist_->counts(CFAHistogram::Green2);
+    const auto*const blue   = fineHist_->counts(CFAHistogram::Blue);
+    for(int fineBin=0; fineBin<fineParams.numBins; ++fineBin)
+    {
+        const auto bin = binNum(fineBin/fineParams.binsPerUnit, binScale, numBins);
+        red_[bin]   += red[fineBin];
+        green_[bin] += green1[fineBin] + green2[fineBin];
+        blue_[bin]  += blue[fineBin];
+    }
+    blackLevelBin_ = binNum(blackLevel_, binScale, numBins);
+    whiteLevelBin_ = binNum(whiteLevel_, binScale, numBins);
+
+    const auto redMax   = *std::max_element(red_.begin(), red_.end());
+    const auto greenMax = *std::max_element(green_.begin(), green_.end());
+    const auto blueMax  = *std::max_element(blue_.begin(), blue_.end());
+    countMax_ = std::max({redMax,(greenMax+1)/2,blueMax});
+}
+
 void RawHistogram::paintEvent(QPaintEvent*)
 {
     QPainter p(this);
@@ -213,7 +248,7 @@ void RawHistogram::paintEvent(QPaintEvent*)
 void RawHistogram::resizeEvent(QResizeEvent*const event)
 {
     if(event->oldSize().width()!=width())
-        compute();
+        rebin();
 }
 
 void RawHistogram::setLogY(const bool enable)
@@ -225,12 +260,44 @@ void RawHistogram::setLogY(const bool enable)
 
 void RawHistogram::onComputed()
 {
-    const auto u = updateWatcher_.future().result();
-    red_   = std::move(u->red);
-    green_ = std::move(u->green);
-    blue_  = std::move(u->blue);
-    blackLevelBin_ = u->blackLevelBin;
-    whiteLevelBin_ = u->whiteLevelBin;
-    countMax_ = u->countMax;
+    fineHist_ = updateWatcher_.future().result();
+    rebin();
+    emit statsUpdated(statsText());
     update();
+
+    if(fineHist_ && fineHist_->sampled() && refineSource_)
+        start(refineSource_, blackLevel_, region_, {});
+    refineSource_.reset();
+}
+
+QString RawHistogram::statsText() const
+{
+    if(!fineHist_) return {};
+
+    const auto& hist = *fineHist_;
+    QString text = region_.isEmpty() ? tr("Whole image") : tr("Region %1\u00d7%2 at (%3, %4)").arg(region_.width())
+                                                                   .arg(region_.height()).arg(region_.x()).arg(region_.y());
+    if(hist.sampled())
+    {
+        text += tr(", estimated from 1/%1 of the rows").arg(hist.params().sample.step);
+        if(refineSource_)
+            text += tr(", refining\u2026");
+    }
+    const auto percent = [](const std::uint64_t count, const std::uint64_t total)
+                         { return QString::number(100.*count/total, 'g', 3); };
+    text += "<table><tr><th></th><th>"+tr("min")+"</th><th>"+tr("median")+"</th><th>"+tr("mean")+"</th>"
+                   "<th>"+tr("max")+"</th><th>"+tr("below black")+"</th><th>"+tr("above white")+"</th></tr>";
+    static const char*const names[CFAHistogram::ChannelCount] = {"R", "G1", "B", "G2"};
+    for(const int c : {CFAHistogram::Red, CFAHistogram::Green1, CFAHistogram::Green2, CFAHistogram::Blue})
+    {
+        const auto& stats = hist.stats(c);
+        if(!stats.total) continue;
+        auto mean = QString::number(stats.mean(), 'f', 1);
+        if(hist.sampled())
+            mean += QString("\u00b1%1").arg(hist.meanHalfWidth95(c), 0, 'f', 1);
+        text += QString("<tr><th>%1</th><td>%2</td><td>%3</td><td>%4</td><td>%5</td><td>%6%</td><td>%7%</td></tr>")
+                    .arg(names[c]).arg(stats.min).arg(hist.percentile(c, 0.5)).arg(mean).arg(stats.max)
+                    .arg(percent(stats.underflow, stats.total)).arg(percent(stats.overflow, stats.total));
+    }
+    return text+"</table>";
 }
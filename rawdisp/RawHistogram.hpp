@@ -4,34 +4,45 @@
 #include <libraw/libraw.h>
 #include <QWidget>
 #include <QFutureWatcher>
+#include "cfa-histogram.hpp"
 
 class RawHistogram : public QWidget
 {
-    std::shared_ptr<LibRaw> libRaw_;
-    std::vector<unsigned> red_, green_, blue_;
+    Q_OBJECT
+
+    // Raw data are binned once per file into fine bins, which are then merged into display bins
+    std::shared_ptr<const CFAHistogram> fineHist_;
+    float whiteLevel_=0;
     float blackLevel_=0;
+    QRect region_;
+    LibRaw const* source_=nullptr; // only to tell whether the data are from the same file as before
+    std::vector<unsigned> red_, green_, blue_;
     unsigned blackLevelBin_=0;
     unsigned whiteLevelBin_=0;
     unsigned countMax_=1;
     bool logarithmic_=true;
-    struct Update
-    {
-        std::vector<unsigned> red, green, blue;
-        unsigned blackLevelBin=0;
-        unsigned whiteLevelBin=0;
-        unsigned countMax=1;
-    };
+    int sampleStep_=1; // of the quick first pass, 1 to compute exact histograms right away
+    std::shared_ptr<LibRaw> refineSource_; // data to compute the exact histogram from after the sampled one
     std::atomic<unsigned> lastUpdateIndex_{0};
-    QFutureWatcher<std::shared_ptr<Update>> updateWatcher_;
+    QFutureWatcher<std::shared_ptr<const CFAHistogram>> updateWatcher_;
 public:
     RawHistogram(QWidget* parent=nullptr);
-    void compute(std::shared_ptr<LibRaw> const& libRaw, const float blackLevel);
+    // The region is in the coordinates of the visible area, empty for the whole image.
+    // Without refinement only the quick sampled pass is done, e.g. while the region is being dragged.
+    void compute(std::shared_ptr<LibRaw> const& libRaw, const float blackLevel, QRect const& region={},
+                 bool refine=true);
+    // Makes the computation in progress, if any, stop without delivering results
+    void cancel();
     void setLogY(bool enable);
     bool logY() const { return logarithmic_; }
+signals:
+    void statsUpdated(QString const& text);
 protected:
     void paintEvent(QPaintEvent* event) override;
     void resizeEvent(QResizeEvent* event) override;
 private:
-    void compute();
+    void start(std::shared_ptr<LibRaw> const& libRaw, float blackLevel, QRect const& region, QuadRowSample sample);
+    void rebin();
     void onComputed();
+    QString statsText() const;
 };
@@ -39,7 +39,7 @@ ToolsWidget::ToolsWidget(QWidget* parent)
 
     mustTransformToSRGB_ = new QCheckBox(tr("Transform from camera to sRGB"));
     mustTransformToSRGB_->setChecked(true);
-    connect(mustTransformToSRGB_, &QCheckBox::stateChanged, this, &ToolsWidget::demosaicSettingChanged);
+    connect(mustTransformToSRGB_, &QCheckBox::stateChanged, this, &ToolsWidget::settingChanged);
     layout->addWidget(mustTransformToSRGB_);
 
     layout->addStretch();
@@ -0,0 +1,92 @@
+#include "qoi.hpp"
+#include <cstring>
+
+namespace
+{
+
+struct Pixel
+{
+    std::uint8_t r, g, b, a;
+    bool operator==(Pixel const& other) const
+    { return r==other.r && g==other.g && b==other.b && a==other.a; }
+};
+
+void appendBigEndian32(QByteArray& out, const std::uint32_t v)
+{
+    out.append(char(v>>24)).append(char(v>>16)).append(char(v>>8)).append(char(v));
+}
+
+}
+
+QByteArray encodeQOI(std::uint8_t const*const rgb, const int width, const int height, const std::size_t stride)
+{
+    enum : std::uint8_t { OP_INDEX=0x00, OP_DIFF=0x40, OP_LUMA=0x80, OP_RUN=0xc0, OP_RGB=0xfe };
+    constexpr int maxRun = 62;
+
+    // Worst case is a tag byte per pixel in addition to the data
+    QByteArray out;
+    out.reserve(14 + 4*std::size_t(width)*height + 8);
+    out.append("qoif", 4);
+    appendBigEndian32(out, width);
+    appendBigEndian32(out, height);
+    out.append(char(3)); // channels
+    out.append(char(0)); // sRGB
+
+    Pixel index[64];
+    std::memset(index, 0, sizeof index);
+    Pixel prev{0,0,0,255};
+    int run = 0;
+    for(int y = 0; y < height; ++y)
+    {
+        const auto*const row = rgb + y*stride;
+        for(int x = 0; x < width; ++x)
+        {
+            const Pixel px{row[3*x], row[3*x+1], row[3*x+2], 255};
+            if(px == prev)
+            {
+                if(++run == maxRun)
+                {
+                    out.append(char(OP_RUN | (run-1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if(run)
+            {
+                out.append(char(OP_RUN | (run-1)));
+                run = 0;
+            }
+
+            const int hash = (px.r*3 + px.g*5 + px.b*7 + px.a*11) % 64;
+            if(index[hash] == px)
+            {
+                out.append(char(OP_INDEX | hash));
+            }
+            else
+            {
+                index[hash] = px;
+                const std::int8_t dr = px.r-prev.r, dg = px.g-prev.g, db = px.b-prev.b;
+                const std::int8_t drg = dr-dg, dbg = db-dg;
+                if(dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    out.append(char(OP_DIFF | (dr+2)<<4 | (dg+2)<<2 | (db+2)));
+                }
+                else if(dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+                {
+                    out.append(char(OP_LUMA | (dg+32)));
+                    out.append(char((drg+8)<<4 | (dbg+8)));
+                }
+                else
+                {
+                    out.append(char(OP_RGB));
+                    out.append(char(px.r)).append(char(px.g)).append(char(px.b));
+                }
+            }
+            prev = px;
+        }
+    }
+    if(run)
+        out.append(char(OP_RUN | (run-1)));
+    out.append("\0\0\0\0\0\0\0\1", 8);
+    return out;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+#include <QByteArray>
+
+// Encodes packed 8-bit sRGB data into the "Quite OK Image" format, which is
+// much faster to write than PNG at a comparable size for photographic images
+QByteArray encodeQOI(std::uint8_t const* rgb, int width, int height, std::size_t stride);
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include "cpu-dispatch.hpp"
+
+inline double sRGBTransferFunction(const double c)
+{
+    return c > 0.0031308 ? 1.055*std::pow(c, 1/2.4)-0.055
+                         : 12.92*c;
+}
+
+// 8-bit sRGB codes of linear values in [0,1] quantized to 16 bits, fine enough to match
+// the exact function everywhere except for a few rounding ties
+inline std::array<std::uint8_t, 65536> const& sRGB8Table()
+{
+    static const auto table = []
+    {
+        std::array<std::uint8_t, 65536> table;
+        for(unsigned i = 0; i < table.size(); ++i)
+            table[i] = std::lround(255*sRGBTransferFunction(i/65535.));
+        return table;
+    }();
+    return table;
+}
+
+// 16-bit sRGB codes of linear values in [0,1]. The linear values are quantized finer than 16 bits,
+// since near black the curve is steep and 16-bit inputs would skip up to 13 output codes.
+inline std::vector<std::uint16_t> const& sRGB16Table()
+{
+    static const auto table = []
+    {
+        std::vector<std::uint16_t> table(1u<<20);
+        for(unsigned i = 0; i < table.size(); ++i)
+            table[i] = std::lround(65535*sRGBTransferFunction(double(i)/(table.size()-1)));
+        return table;
+    }();
+    return table;
+}
+
+// Converts linear camera RGB with the given color matrix to sRGB codes looked up in the table. The input
+// has inChannels values per pixel, of which the first three are used. The output has outChannels values per
+// pixel, 3 or 4, the fourth being set to opaque. Strides are in elements. Rows are converted in parallel
+// bands. Pixel can be anything convertible to float, e.g. qfloat16.
+template<typename Pixel, typename Table, typename Out>
+void linearToSRGB(Pixel const*const in, const int inChannels, const std::size_t inStride,
+                  const int width, const int height, const bool inBottomRowFirst,
+                  const float (&matrix)[3][3], Table const& table, Out*const out,
+                  const int outChannels, const std::size_t outStride, const Out opaque)
+{
+    const float maxIndex = table.size()-1;
+    const auto convertRows = [&](const int yBegin, const int yEnd)
+    {
+        std::vector<float> rgb(3*width);
+        for(int y = yBegin; y < yEnd; ++y)
+        {
+            const auto*const src = in + (inBottomRowFirst ? height-1-y : y)*inStride;
+            for(int x = 0; x < width; ++x)
+                for(int c = 0; c < 3; ++c)
+                    rgb[3*x+c] = float(src[inChannels*x+c]);
+            // Branchless and free of library calls, so that the compiler can vectorize it.
+            // Out-of-range values and NaNs are clamped to the ends of the table.
+            auto*const dst = out + y*outStride;
+            for(int x = 0; x < width; ++x)
+            {
+                const float r = rgb[3*x+0], g = rgb[3*x+1], b = rgb[3*x+2];
+                for(int c = 0; c < 3; ++c)
+                {
+                    const float v = matrix[c][0]*r + matrix[c][1]*g + matrix[c][2]*b;
+                    const int index = std::min(std::max(0.f, v*maxIndex+0.5f), maxIndex);
+                    dst[outChannels*x+c] = table[index];
+                }
+            }
+            if(outChannels == 4)
+            {
+                for(int x = 0; x < width; ++x)
+                    dst[4*x+3] = opaque;
+            }
+        }
+    };
+
+    const int bandCount = std::max(1, std::min(height, 2*QThreadPool::globalInstance()->maxThreadCount()));
+    std::vector<int> bands(bandCount);
+    for(int n = 0; n < bandCount; ++n)
+        bands[n] = n;
+    QtConcurrent::blockingMap(bands, [&](const int n)
+                              { dispatchISA([&]{ convertRows(std::int64_t(height)*n/bandCount, std::int64_t(height)*(n+1)/bandCount); }); });
+}
+
+// Output is packed RGB, 8 bits per channel
+template<typename Pixel>
+void linearToSRGB8(Pixel const*const in, const int inChannels, const std::size_t inStride,
+                   const int width, const int height, const bool inBottomRowFirst,
+                   const float (&matrix)[3][3], std::uint8_t*const out, const std::size_t outStride)
+{
+    linearToSRGB(in, inChannels, inStride, width, height, inBottomRowFirst, matrix, sRGB8Table(),
+                 out, 3, outStride, std::uint8_t(255));
+}
+
+// Output is opaque RGBA, 16 bits per channel, as in QImage::Format_RGBA64. The stride is in bytes.
+template<typename Pixel>
+void linearToSRGB16(Pixel const*const in, const int inChannels, const std::size_t inStride,
+                    const int width, const int height, const bool inBottomRowFirst,
+                    const float (&matrix)[3][3], std::uint16_t*const out, const std::size_t outStrideBytes)
+{
+    linearToSRGB(in, inChannels, inStride, width, height, inBottomRowFirst, matrix, sRGB16Table(),
+                 out, 4, outStrideBytes/sizeof out[0], std::uint16_t(65535));
+}
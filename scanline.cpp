@@ -6,6 +6,8 @@
 #include <vector>
 #include <limits>
 #include <cassert>
+#include <type_traits>
+#include "cfa-kernels.hpp"
 
 inline int usage(const char* argv0, int returnValue)
 {
@@ -15,29 +17,46 @@ inline int usage(const char* argv0, int returnValue)
 
 void printScanLineData(LibRaw& libRaw, const ushort (*img)[4], const int w, const int h, const int scanLineY)
 {
-    std::vector<unsigned> valuesRed;
-    std::vector<unsigned> valuesGreen1;
-    std::vector<unsigned> valuesGreen2;
-    std::vector<unsigned> valuesBlue;
-    int tooBlackPixelCount=0, tooWhitePixelCount=0;
+    std::vector<unsigned> values[4]; // R, G1, B, G2
     std::cerr << "Extracting scanline...\n";
-    for(int y=scanLineY;y<=scanLineY+1;++y)
+    // Takes the photosites of a row that have the given channel, starting from xBegin with step 2
+    const auto extract=[&](const ushort (*row)[4], const int xBegin, auto channelTag)
     {
-        for(int x=0;x<w;++x)
+        constexpr int channel=decltype(channelTag)::value;
+        for(int x=xBegin;x<w;x+=2)
+            values[channel].emplace_back(row[x][channel]);
+    };
+    int channels[2][2];
+    for(int row=0;row<2;++row)
+        for(int col=0;col<2;++col)
+            channels[row][col]=libRaw.COLOR(row,col);
+    const bool isBayer=dispatchBayerLayout(channels, [&](auto layout)
+    {
+        using Layout=decltype(layout);
+        for(int y=scanLineY;y<=scanLineY+1;++y)
         {
-            const auto colIndex=libRaw.FC(y,x);
-            const auto pixel=img[x+y*w][colIndex];
-
-            switch(colIndex)
+            const auto*const row=img+std::size_t(y)*w;
+            if(y%2==0)
             {
-            case 0: valuesRed   .emplace_back(pixel); break;
-            case 1: valuesGreen1.emplace_back(pixel); break;
-            case 2: valuesBlue  .emplace_back(pixel); break;
-            case 3: valuesGreen2.emplace_back(pixel); break;
-            default: assert(!"Must not get here!");
+                extract(row, 0, std::integral_constant<int,Layout::c00>{});
+                extract(row, 1, std::integral_constant<int,Layout::c01>{});
+            }
+            else
+            {
+                extract(row, 0, std::integral_constant<int,Layout::c10>{});
+                extract(row, 1, std::integral_constant<int,Layout::c11>{});
             }
         }
+    });
+    if(!isBayer)
+    {
+        std::cerr << "Only Bayer CFA is supported\n";
+        return;
     }
+    const auto& valuesRed=values[0];
+    const auto& valuesGreen1=values[1];
+    const auto& valuesBlue=values[2];
+    const auto& valuesGreen2=values[3];
     assert(valuesRed.size()==valuesGreen1.size());
     assert(valuesGreen1.size()==valuesGreen2.size());
     assert(valuesGreen2.size()==valuesBlue.size());